@@ -0,0 +1,41 @@
+#ifndef _BACKPRESSURE_H
+#define _BACKPRESSURE_H
+
+/*
+ * What a thread submitting work does when a task system is already
+ * holding as much unfinished work as its SubmissionLimits allow:
+ *  - OVERLOAD_BLOCK: sleep until enough of that work is done.
+ *  - OVERLOAD_HELP: run queued tasks until enough of it is done.
+ *  - OVERLOAD_REJECT: return at once without launching anything. The
+ *    launch gets REJECTED_TASK (see itasksys.h) for its TaskID, which
+ *    later launches that name it as a dependency treat as done.
+ *
+ * A submission from inside a running task helps rather than blocks, and
+ * goes over the limits once nothing is left to help with, since what it
+ * would wait for may be waiting for its task. Calls that have no TaskID
+ * to return, such as run(), help rather than reject.
+ */
+enum OverloadPolicy {
+    OVERLOAD_BLOCK,
+    OVERLOAD_HELP,
+    OVERLOAD_REJECT,
+};
+
+/*
+ * Bounds the work a task system holds before it is done: max_groups
+ * unfinished bulk launches, and max_tasks tasks among them, with 0
+ * meaning no bound. A submission that would go over either bound is
+ * held back under policy, unless nothing at all is in flight, so that a
+ * single launch larger than the bounds still runs.
+ */
+struct SubmissionLimits {
+    int max_groups = 0;
+    long long max_tasks = 0;
+    OverloadPolicy policy = OVERLOAD_BLOCK;
+
+    bool enabled() const {
+        return max_groups > 0 || max_tasks > 0;
+    }
+};
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef _CPUTOPOLOGY_H
+#define _CPUTOPOLOGY_H
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ * Where the worker threads of a thread pool run:
+ *  - PLACEMENT_NONE: wherever the kernel puts them.
+ *  - PLACEMENT_COMPACT: as close together as possible, filling every
+ *    hardware thread of a core, then the cores of a package, before
+ *    moving on to the next package.
+ *  - PLACEMENT_SCATTER: as far apart as possible, round robin over the
+ *    NUMA nodes, and one hardware thread per core before doubling up.
+ *  - PLACEMENT_LIST: worker i on cpus[i % cpus.size()].
+ *
+ * Each placed worker is pinned to a single CPU out of those the process
+ * may run on; with more workers than CPUs the placement wraps around.
+ * The topology comes from /sys/devices/system. Where it cannot be read,
+ * every CPU counts as a core of its own in a single node.
+ */
+enum PlacementPolicy {
+    PLACEMENT_NONE,
+    PLACEMENT_COMPACT,
+    PLACEMENT_SCATTER,
+    PLACEMENT_LIST,
+};
+
+struct ThreadPlacement {
+    PlacementPolicy policy = PLACEMENT_NONE;
+    std::vector<int> cpus;
+};
+
+struct CpuInfo {
+    int cpu;
+    int core;       // only unique within its package
+    int package;
+    int node;
+};
+
+// Parses a CPU list such as "0-3,8,10-11", as found in sysfs.
+inline std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        char *end;
+        const long first = strtol(list.c_str() + pos, &end, 10);
+        if (end == list.c_str() + pos) {
+            break;
+        }
+        long last = first;
+        if (*end == '-') {
+            const char *last_begin = end + 1;
+            last = strtol(last_begin, &end, 10);
+            if (end == last_begin) {
+                break;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+        pos = end - list.c_str();
+        if (pos < list.size() && list[pos] == ',') {
+            pos++;
+        } else {
+            break;
+        }
+    }
+    return cpus;
+}
+
+inline bool read_sysfs_line(const std::string& path, std::string& line) {
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == NULL) {
+        return false;
+    }
+    char buffer[4096];
+    const bool ok = fgets(buffer, sizeof(buffer), file) != NULL;
+    fclose(file);
+    if (ok) {
+        line = buffer;
+        line.erase(line.find_last_not_of(" \n") + 1);
+    }
+    return ok;
+}
+
+inline int read_sysfs_int(const std::string& path, int fallback) {
+    std::string line;
+    return read_sysfs_line(path, line) && !line.empty() ? atoi(line.c_str()) : fallback;
+}
+
+// The CPUs this process may run on, with their place in the machine.
+inline std::vector<CpuInfo> read_cpu_topology() {
+    std::vector<int> online;
+    std::string line;
+    if (read_sysfs_line("/sys/devices/system/cpu/online", line)) {
+        online = parse_cpu_list(line);
+    }
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        if (online.empty()) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                online.push_back(cpu);
+            }
+        }
+        online.erase(std::remove_if(online.begin(), online.end(), [&allowed](int cpu) {
+            return cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed);
+        }), online.end());
+    }
+#endif
+
+    std::vector<CpuInfo> topology;
+    for (int cpu : online) {
+        const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        topology.push_back({cpu, read_sysfs_int(dir + "core_id", cpu),
+                            read_sysfs_int(dir + "physical_package_id", 0), 0});
+    }
+
+    if (read_sysfs_line("/sys/devices/system/node/online", line)) {
+        for (int node : parse_cpu_list(line)) {
+            std::string cpulist;
+            if (!read_sysfs_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", cpulist)) {
+                continue;
+            }
+            for (int cpu : parse_cpu_list(cpulist)) {
+                for (CpuInfo &info : topology) {
+                    if (info.cpu == cpu) {
+                        info.node = node;
+                    }
+                }
+            }
+        }
+    }
+    return topology;
+}
+
+inline int num_cpu_nodes(const std::vector<CpuInfo>& topology) {
+    int num_nodes = 1;
+    for (const CpuInfo &info : topology) {
+        num_nodes = std::max(num_nodes, info.node + 1);
+    }
+    return num_nodes;
+}
+
+// The NUMA node of cpu, or 0 if it is unknown.
+inline int cpu_node(const std::vector<CpuInfo>& topology, int cpu) {
+    for (const CpuInfo &info : topology) {
+        if (info.cpu == cpu) {
+            return info.node;
+        }
+    }
+    return 0;
+}
+
+// The NUMA node of every CPU, indexed by CPU number, for lookups on hot
+// paths. CPUs missing from topology map to node 0.
+inline std::vector<int> cpu_node_table(const std::vector<CpuInfo>& topology) {
+    std::vector<int> nodes;
+    for (const CpuInfo &info : topology) {
+        if (info.cpu >= static_cast<int>(nodes.size())) {
+            nodes.resize(info.cpu + 1, 0);
+        }
+        nodes[info.cpu] = info.node;
+    }
+    return nodes;
+}
+
+/*
+ * The CPU each of num_threads workers should be pinned to, or -1 where a
+ * worker is left alone.
+ */
+inline std::vector<int> place_threads(const ThreadPlacement& placement, int num_threads,
+                                      const std::vector<CpuInfo>& topology) {
+    std::vector<int> order;
+    if (placement.policy == PLACEMENT_LIST) {
+        order = placement.cpus;
+    } else if (placement.policy == PLACEMENT_COMPACT) {
+        std::vector<CpuInfo> cpus = topology;
+        std::sort(cpus.begin(), cpus.end(), [](const CpuInfo& a, const CpuInfo& b) {
+            if (a.node != b.node) return a.node < b.node;
+            if (a.package != b.package) return a.package < b.package;
+            if (a.core != b.core) return a.core < b.core;
+            return a.cpu < b.cpu;
+        });
+        for (const CpuInfo &info : cpus) {
+            order.push_back(info.cpu);
+        }
+    } else if (placement.policy == PLACEMENT_SCATTER) {
+        // Rank each CPU among the hardware threads of its core, so that
+        // every core gets one worker before any gets a second.
+        std::vector<std::pair<int, CpuInfo>> ranked;
+        for (const CpuInfo &info : topology) {
+            int rank = 0;
+            for (const CpuInfo &other : topology) {
+                if (other.package == info.package && other.core == info.core && other.cpu < info.cpu) {
+                    rank++;
+                }
+            }
+            ranked.push_back({rank, info});
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const std::pair<int, CpuInfo>& a, const std::pair<int, CpuInfo>& b) {
+            if (a.first != b.first) return a.first < b.first;
+            if (a.second.package != b.second.package) return a.second.package < b.second.package;
+            if (a.second.core != b.second.core) return a.second.core < b.second.core;
+            return a.second.cpu < b.second.cpu;
+        });
+
+        std::vector<std::vector<int>> per_node(num_cpu_nodes(topology));
+        for (const std::pair<int, CpuInfo> &entry : ranked) {
+            per_node[entry.second.node].push_back(entry.second.cpu);
+        }
+        for (size_t i = 0; order.size() < topology.size(); i++) {
+            for (const std::vector<int> &node_cpus : per_node) {
+                if (i < node_cpus.size()) {
+                    order.push_back(node_cpus[i]);
+                }
+            }
+        }
+    }
+
+    std::vector<int> worker_cpus(num_threads, -1);
+    if (!order.empty()) {
+        for (int i = 0; i < num_threads; i++) {
+            worker_cpus[i] = order[i % order.size()];
+        }
+    }
+    return worker_cpus;
+}
+
+// Pins the calling thread to cpu. Returns false if that is not possible.
+inline bool pin_current_thread(int cpu) {
+#ifdef __linux__
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// The CPU the calling thread is running on, or -1 if it is unknown.
+inline int current_cpu() {
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _ELASTIC_H
+#define _ELASTIC_H
+
+#include <algorithm>
+
+/*
+ * Lets a thread pool run fewer workers than its num_threads while there
+ * is little to do. An elastic pool starts min_threads workers. A worker
+ * that has found no work for retire_after seconds exits, as long as
+ * min_threads others remain, and the pool starts workers again, up to
+ * num_threads, when work is queued that no idle worker is left to take.
+ *
+ * With retire_after == 0 (the default) the pool is not elastic: all
+ * num_threads workers live as long as the pool does.
+ */
+struct ElasticBounds {
+    int min_threads = 1;
+    double retire_after = 0;
+
+    bool enabled() const {
+        return retire_after > 0;
+    }
+};
+
+// bounds with min_threads brought into [1, num_threads].
+inline ElasticBounds clamp_bounds(ElasticBounds bounds, int num_threads) {
+    bounds.min_threads = std::max(1, std::min(bounds.min_threads, num_threads));
+    return bounds;
+}
+
+#endif
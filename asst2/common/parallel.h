@@ -0,0 +1,255 @@
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+#include "itasksys.h"
+#include <algorithm>
+#include <climits>
+#include <thread>
+#include <vector>
+
+/*
+ * Loop-level parallelism on top of ITaskSystem, without writing an
+ * IRunnable by hand:
+ *
+ *   parallel_for(t, 0, n, [&](long long i) { y[i] += a * x[i]; });
+ *   float sum = parallel_reduce(t, 0, n, 0.0f,
+ *                               [&](long long i) { return x[i]; },
+ *                               [](float a, float b) { return a + b; });
+ *
+ * [begin, end) is cut into tasks of grain consecutive iterations each,
+ * which become one bulk task launch. The loop bodies are template
+ * arguments, so they are inlined into the loop over each task's
+ * iterations rather than called through a virtual function. Both calls,
+ * and the scans below, block like run(). They may only be used from
+ * inside a task on task systems that support nested launches, such as
+ * part B's thread pool that sleeps (see sync() in itasksys.h); part A's
+ * thread pools run one launch at a time.
+ *
+ * Without an explicit grain, the range is cut into a few tasks per
+ * hardware thread, enough for the task system to even out iterations of
+ * uneven cost. A range that fits in a single task runs on the calling
+ * thread without launching anything.
+ */
+
+namespace parallel_detail {
+
+const int TASKS_PER_THREAD = 8;
+
+inline long long default_grain(long long num_iterations) {
+    const long long num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const long long num_tasks = num_threads * TASKS_PER_THREAD;
+    return std::max(1LL, (num_iterations + num_tasks - 1) / num_tasks);
+}
+
+// A bulk launch's task count is an int, so very long ranges need bigger
+// tasks than asked for.
+inline long long checked_grain(long long num_iterations, long long grain) {
+    grain = std::max(1LL, grain);
+    return std::max(grain, (num_iterations + INT_MAX - 1) / INT_MAX);
+}
+
+template <typename Body>
+class ForRunnable: public IRunnable {
+    public:
+        ForRunnable(long long begin, long long end, long long grain, const Body& body)
+            : begin_(begin), end_(end), grain_(grain), body_(body) {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            const long long first = begin_ + task_id * grain_;
+            const long long last = std::min(first + grain_, end_);
+            for (long long i = first; i < last; i++) {
+                body_(i);
+            }
+        }
+
+    private:
+        const long long begin_;
+        const long long end_;
+        const long long grain_;
+        const Body& body_;
+};
+
+// Wrapped so that a vector of them never turns into a vector<bool>, whose
+// elements cannot be written from different threads.
+template <typename T>
+struct Partial {
+    T value;
+};
+
+template <typename T, typename Map, typename Combine>
+class ReduceRunnable: public IRunnable {
+    public:
+        ReduceRunnable(long long begin, long long end, long long grain, const T& identity,
+                       const Map& map, const Combine& combine, std::vector<Partial<T>>& partials)
+            : begin_(begin), end_(end), grain_(grain), identity_(identity), map_(map),
+              combine_(combine), partials_(partials) {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            const long long first = begin_ + task_id * grain_;
+            const long long last = std::min(first + grain_, end_);
+            T partial = identity_;
+            for (long long i = first; i < last; i++) {
+                partial = combine_(partial, map_(i));
+            }
+            partials_[task_id].value = partial;
+        }
+
+    private:
+        const long long begin_;
+        const long long end_;
+        const long long grain_;
+        const T& identity_;
+        const Map& map_;
+        const Combine& combine_;
+        std::vector<Partial<T>>& partials_;
+};
+
+}
+
+/*
+ * Calls body(i) for every i in [begin, end), in parallel tasks of grain
+ * iterations.
+ */
+template <typename Body>
+void parallel_for(ITaskSystem* t, long long begin, long long end, long long grain, const Body& body) {
+    if (begin >= end) {
+        return;
+    }
+    grain = parallel_detail::checked_grain(end - begin, grain);
+    if (end - begin <= grain) {
+        for (long long i = begin; i < end; i++) {
+            body(i);
+        }
+        return;
+    }
+
+    const int num_tasks = static_cast<int>((end - begin + grain - 1) / grain);
+    parallel_detail::ForRunnable<Body> runnable(begin, end, grain, body);
+    t->run(&runnable, num_tasks);
+}
+
+template <typename Body>
+void parallel_for(ITaskSystem* t, long long begin, long long end, const Body& body) {
+    parallel_for(t, begin, end, parallel_detail::default_grain(end - begin), body);
+}
+
+/*
+ * Returns identity combined with map(i) for every i in [begin, end), in
+ * order: combine must be associative, but need not be commutative. Each
+ * task folds its grain iterations into a partial result, and the partial
+ * results are combined on the calling thread.
+ */
+template <typename T, typename Map, typename Combine>
+T parallel_reduce(ITaskSystem* t, long long begin, long long end, long long grain,
+                  const T& identity, const Map& map, const Combine& combine) {
+    if (begin >= end) {
+        return identity;
+    }
+    grain = parallel_detail::checked_grain(end - begin, grain);
+    const int num_tasks = static_cast<int>((end - begin + grain - 1) / grain);
+
+    std::vector<parallel_detail::Partial<T>> partials(num_tasks, {identity});
+    parallel_detail::ReduceRunnable<T, Map, Combine> runnable(
+        begin, end, grain, identity, map, combine, partials);
+    if (num_tasks == 1) {
+        runnable.runTask(0, 1);
+    } else {
+        t->run(&runnable, num_tasks);
+    }
+
+    T result = identity;
+    for (const parallel_detail::Partial<T>& partial : partials) {
+        result = combine(result, partial.value);
+    }
+    return result;
+}
+
+template <typename T, typename Map, typename Combine>
+T parallel_reduce(ITaskSystem* t, long long begin, long long end, const T& identity,
+                  const Map& map, const Combine& combine) {
+    return parallel_reduce(t, begin, end, parallel_detail::default_grain(end - begin),
+                           identity, map, combine);
+}
+
+/*
+ * Prefix scans of input[0, n) into output[0, n) under an associative op
+ * with the given identity (by default +, starting from T()):
+ *
+ *   inclusive: output[i] = input[0] op ... op input[i]
+ *   exclusive: output[i] = identity op input[0] op ... op input[i - 1]
+ *
+ * Both take two parallel passes over the data. The first reduces each
+ * block of the array to its total; a serial scan of those few totals gives
+ * every block its starting value; the second pass then scans each block
+ * from its starting value. output may be the same array as input.
+ *
+ * Blocks are combined in a different order than a serial scan would, so
+ * floating-point results can differ from one in rounding.
+ */
+template <typename T, typename Op>
+void parallel_scan(ITaskSystem* t, const T* input, T* output, long long n,
+                   const T& identity, const Op& op, bool inclusive) {
+    if (n <= 0) {
+        return;
+    }
+    const long long block_size = parallel_detail::checked_grain(n, parallel_detail::default_grain(n));
+    const long long num_blocks = (n + block_size - 1) / block_size;
+
+    std::vector<parallel_detail::Partial<T>> block_starts(num_blocks, {identity});
+    if (num_blocks > 1) {
+        parallel_for(t, 0, num_blocks - 1, 1, [&](long long block) {
+            const long long first = block * block_size;
+            const long long last = first + block_size;
+            T total = identity;
+            for (long long i = first; i < last; i++) {
+                total = op(total, input[i]);
+            }
+            block_starts[block + 1].value = total;
+        });
+        for (long long block = 1; block < num_blocks; block++) {
+            block_starts[block].value = op(block_starts[block - 1].value, block_starts[block].value);
+        }
+    }
+
+    parallel_for(t, 0, num_blocks, 1, [&](long long block) {
+        const long long first = block * block_size;
+        const long long last = std::min(first + block_size, n);
+        T running = block_starts[block].value;
+        if (inclusive) {
+            for (long long i = first; i < last; i++) {
+                running = op(running, input[i]);
+                output[i] = running;
+            }
+        } else {
+            for (long long i = first; i < last; i++) {
+                const T value = input[i];
+                output[i] = running;
+                running = op(running, value);
+            }
+        }
+    });
+}
+
+template <typename T, typename Op>
+void parallel_inclusive_scan(ITaskSystem* t, const T* input, T* output, long long n,
+                             const T& identity, const Op& op) {
+    parallel_scan(t, input, output, n, identity, op, true);
+}
+
+template <typename T>
+void parallel_inclusive_scan(ITaskSystem* t, const T* input, T* output, long long n) {
+    parallel_scan(t, input, output, n, T(), [](const T& a, const T& b) { return a + b; }, true);
+}
+
+template <typename T, typename Op>
+void parallel_exclusive_scan(ITaskSystem* t, const T* input, T* output, long long n,
+                             const T& identity, const Op& op) {
+    parallel_scan(t, input, output, n, identity, op, false);
+}
+
+template <typename T>
+void parallel_exclusive_scan(ITaskSystem* t, const T* input, T* output, long long n) {
+    parallel_scan(t, input, output, n, T(), [](const T& a, const T& b) { return a + b; }, false);
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef _TASKGRAPH_H
+#define _TASKGRAPH_H
+
+#include "itasksys.h"
+#include <algorithm>
+#include <vector>
+
+/*
+ * An immutable DAG of bulk task launches, captured once with a
+ * TaskGraphRecorder and then launched as a whole, any number of times, with
+ * ITaskSystem::replay().
+ *
+ * Nodes are numbered in the order their launches were recorded, so every
+ * dependency of a node has a smaller index than the node itself. Both the
+ * dependencies and the successors of each node are stored in flat arrays,
+ * so a task system can resolve them without building anything per replay.
+ * So is each node's bottom level: the most tasks on any path from the node
+ * to the end of the graph, its own included, which a task system can use
+ * to run the critical path first.
+ */
+class TaskGraph {
+    public:
+        struct Node {
+            IRunnable* runnable;
+            int num_total_tasks;
+            int num_dependencies;
+            int first_dependency;
+            int num_successors;
+            int first_successor;
+            long long bottom_level;
+        };
+
+        int size() const {
+            return static_cast<int>(nodes_.size());
+        }
+
+        const Node& node(int i) const {
+            return nodes_[i];
+        }
+
+        // The num_dependencies nodes that node i waits for.
+        const int* dependencies(int i) const {
+            return dependencies_.data() + nodes_[i].first_dependency;
+        }
+
+        // The num_successors nodes that wait for node i.
+        const int* successors(int i) const {
+            return successors_.data() + nodes_[i].first_successor;
+        }
+
+        // Nodes without dependencies, in recording order.
+        const std::vector<int>& roots() const {
+            return roots_;
+        }
+
+    private:
+        friend class TaskGraphRecorder;
+
+        std::vector<Node> nodes_;
+        std::vector<int> dependencies_;
+        std::vector<int> successors_;
+        std::vector<int> roots_;
+};
+
+/*
+ * A task system that runs nothing and instead records the launches made
+ * on it, so that code written against ITaskSystem can be captured
+ * unchanged. graph() returns what has been recorded so far.
+ *
+ * The TaskIDs it hands out are only meaningful to the recorder itself;
+ * dependencies on launches that were not recorded by it are ignored.
+ * sync() and wait() become barriers: every launch recorded after them
+ * depends on every launch recorded before. run() is recorded as a launch
+ * between two such barriers.
+ */
+class TaskGraphRecorder: public ITaskSystem {
+    public:
+        TaskGraphRecorder(): ITaskSystem(0) {}
+
+        const char* name() {
+            return "Task Graph Recorder";
+        }
+
+        void run(IRunnable* runnable, int num_total_tasks) {
+            sync();
+            runAsyncWithDeps(runnable, num_total_tasks, std::vector<TaskID>());
+            sync();
+        }
+
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps) {
+            std::vector<int> node_deps = barrier_;
+            for (TaskID dep : deps) {
+                if (dep >= 1 && dep <= static_cast<int>(nodes_.size())) {
+                    node_deps.push_back(dep - 1);
+                }
+            }
+            std::sort(node_deps.begin(), node_deps.end());
+            node_deps.erase(std::unique(node_deps.begin(), node_deps.end()), node_deps.end());
+
+            nodes_.push_back({runnable, num_total_tasks});
+            deps_.push_back(node_deps);
+            return static_cast<TaskID>(nodes_.size());
+        }
+
+        void sync() {
+            if (first_unsynced_ == static_cast<int>(nodes_.size())) {
+                return;
+            }
+            // Launches since the previous barrier already depend on it, so
+            // they alone stand for everything recorded so far.
+            barrier_.clear();
+            for (int i = first_unsynced_; i < static_cast<int>(nodes_.size()); i++) {
+                barrier_.push_back(i);
+            }
+            first_unsynced_ = static_cast<int>(nodes_.size());
+        }
+
+        TaskGraph graph() const {
+            TaskGraph graph;
+            const int num_nodes = static_cast<int>(nodes_.size());
+            graph.nodes_.resize(num_nodes);
+
+            std::vector<int> num_successors(num_nodes, 0);
+            for (int i = 0; i < num_nodes; i++) {
+                TaskGraph::Node& node = graph.nodes_[i];
+                node.runnable = nodes_[i].runnable;
+                node.num_total_tasks = nodes_[i].num_total_tasks;
+                node.num_dependencies = static_cast<int>(deps_[i].size());
+                node.first_dependency = static_cast<int>(graph.dependencies_.size());
+                for (int dep : deps_[i]) {
+                    graph.dependencies_.push_back(dep);
+                    num_successors[dep]++;
+                }
+                if (deps_[i].empty()) {
+                    graph.roots_.push_back(i);
+                }
+            }
+
+            int first_successor = 0;
+            for (int i = 0; i < num_nodes; i++) {
+                graph.nodes_[i].num_successors = 0;
+                graph.nodes_[i].first_successor = first_successor;
+                first_successor += num_successors[i];
+            }
+            graph.successors_.resize(first_successor);
+            for (int i = 0; i < num_nodes; i++) {
+                for (int dep : deps_[i]) {
+                    TaskGraph::Node& pred = graph.nodes_[dep];
+                    graph.successors_[pred.first_successor + pred.num_successors++] = i;
+                }
+            }
+
+            // Successors always come later, so one pass from the end sees
+            // every successor's bottom level before the node's own.
+            for (int i = num_nodes - 1; i >= 0; i--) {
+                TaskGraph::Node& node = graph.nodes_[i];
+                long long successor_level = 0;
+                for (int j = 0; j < node.num_successors; j++) {
+                    successor_level = std::max(successor_level,
+                                               graph.nodes_[graph.successors_[node.first_successor + j]].bottom_level);
+                }
+                node.bottom_level = std::max(0, node.num_total_tasks) + successor_level;
+            }
+
+            return graph;
+        }
+
+    private:
+        struct RecordedLaunch {
+            IRunnable* runnable;
+            int num_total_tasks;
+        };
+
+        std::vector<RecordedLaunch> nodes_;
+        std::vector<std::vector<int>> deps_;
+        std::vector<int> barrier_;
+        int first_unsynced_ = 0;
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef _TASKSTATS_H
+#define _TASKSTATS_H
+
+#include "CycleTimer.h"
+#include <atomic>
+#include <mutex>
+#include <stdio.h>
+
+/*
+ * Optional runtime counters for the task systems, to tell queue
+ * contention, idle workers and load imbalance apart when a test is slow.
+ *
+ * They are only collected in builds with TASKSYS_STATS defined (make
+ * STATS=1). Otherwise ThreadStats is empty, its methods do nothing and
+ * stats_clock() is a constant, so every use compiles away.
+ *
+ * A task system keeps one ThreadStats per worker, plus one shared by all
+ * threads outside the pool (callers of run() and sync() that help out).
+ * Each is on its own cache lines and is normally only written by its own
+ * thread, so counting costs no more than a few uncontended atomic adds.
+ */
+
+#ifdef TASKSYS_STATS
+const bool TASK_STATS_ENABLED = true;
+#else
+const bool TASK_STATS_ENABLED = false;
+#endif
+
+inline double stats_clock() {
+    return TASK_STATS_ENABLED ? CycleTimer::currentSeconds() : 0.0;
+}
+
+class ThreadStats {
+    public:
+        void count_tasks(long long num_tasks) {
+#ifdef TASKSYS_STATS
+            add(tasks_executed_, num_tasks);
+#endif
+        }
+
+        // Time spent running tasks.
+        void add_busy(double seconds) {
+#ifdef TASKSYS_STATS
+            add(busy_ns_, to_ns(seconds));
+#endif
+        }
+
+        // Time spent parked, waiting to be woken up.
+        void add_idle(double seconds) {
+#ifdef TASKSYS_STATS
+            add(idle_ns_, to_ns(seconds));
+#endif
+        }
+
+        // Time spent spinning or polling for work.
+        void add_spin(double seconds) {
+#ifdef TASKSYS_STATS
+            add(spin_ns_, to_ns(seconds));
+#endif
+        }
+
+        // One acquisition of a lock that was held, and how long it took.
+        void add_lock_wait(double seconds) {
+#ifdef TASKSYS_STATS
+            add(lock_waits_, 1);
+            add(lock_wait_ns_, to_ns(seconds));
+#endif
+        }
+
+        void count_steal() {
+#ifdef TASKSYS_STATS
+            add(steals_, 1);
+#endif
+        }
+
+        void count_wakeup() {
+#ifdef TASKSYS_STATS
+            add(wakeups_, 1);
+#endif
+        }
+
+        // Called with the depth of this thread's queue after a push, under
+        // the queue's lock.
+        void note_queue_depth(long long depth) {
+#ifdef TASKSYS_STATS
+            if (depth > max_queue_depth_.load(std::memory_order_relaxed)) {
+                max_queue_depth_.store(depth, std::memory_order_relaxed);
+            }
+#endif
+        }
+
+    private:
+        friend class TaskStats;
+
+#ifdef TASKSYS_STATS
+        static long long to_ns(double seconds) {
+            return static_cast<long long>(seconds * 1e9);
+        }
+
+        static void add(std::atomic<long long>& counter, long long value) {
+            counter.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        std::atomic<long long> tasks_executed_{0};
+        std::atomic<long long> busy_ns_{0};
+        std::atomic<long long> idle_ns_{0};
+        std::atomic<long long> spin_ns_{0};
+        std::atomic<long long> lock_waits_{0};
+        std::atomic<long long> lock_wait_ns_{0};
+        std::atomic<long long> steals_{0};
+        std::atomic<long long> wakeups_{0};
+        std::atomic<long long> max_queue_depth_{0};
+        char padding[64]; // keep neighbouring threads' counters apart
+#endif
+};
+
+/*
+ * Acquires lock, and if its mutex was held, counts the time spent waiting
+ * for it. Uncontended acquisitions never read the clock.
+ */
+inline void lock_counted(std::unique_lock<std::mutex>& lock, ThreadStats& stats) {
+    if (!TASK_STATS_ENABLED) {
+        lock.lock();
+        return;
+    }
+    if (lock.try_lock()) {
+        return;
+    }
+    const double start = stats_clock();
+    lock.lock();
+    stats.add_lock_wait(stats_clock() - start);
+}
+
+class TaskStats {
+    public:
+        explicit TaskStats(int num_threads)
+            : num_threads_(num_threads), threads_(new ThreadStats[num_threads + 1]) {}
+
+        ~TaskStats() {
+            delete[] threads_;
+        }
+
+        TaskStats(const TaskStats&) = delete;
+        TaskStats& operator=(const TaskStats&) = delete;
+
+        // Worker i's counters; i == num_threads for threads outside the pool.
+        ThreadStats& thread(int i) {
+            return threads_[i];
+        }
+
+        // Prints one line per thread and a total to stdout.
+        void dump(const char* name) const {
+#ifdef TASKSYS_STATS
+            printf("[%s] statistics:\n", name);
+            printf("  %-8s %12s %10s %10s %10s %10s %10s %8s %8s %6s\n", "thread", "tasks",
+                   "busy ms", "idle ms", "spin ms", "lock waits", "lock ms", "steals", "wakeups",
+                   "max q");
+            ThreadStats total;
+            for (int i = 0; i <= num_threads_; i++) {
+                const ThreadStats& stats = threads_[i];
+                char label[16];
+                if (i < num_threads_) {
+                    snprintf(label, sizeof(label), "%d", i);
+                } else {
+                    snprintf(label, sizeof(label), "caller");
+                }
+                print_line(label, stats);
+
+                ThreadStats::add(total.tasks_executed_, stats.tasks_executed_.load());
+                ThreadStats::add(total.busy_ns_, stats.busy_ns_.load());
+                ThreadStats::add(total.idle_ns_, stats.idle_ns_.load());
+                ThreadStats::add(total.spin_ns_, stats.spin_ns_.load());
+                ThreadStats::add(total.lock_waits_, stats.lock_waits_.load());
+                ThreadStats::add(total.lock_wait_ns_, stats.lock_wait_ns_.load());
+                ThreadStats::add(total.steals_, stats.steals_.load());
+                ThreadStats::add(total.wakeups_, stats.wakeups_.load());
+                total.note_queue_depth(stats.max_queue_depth_.load());
+            }
+            print_line("total", total);
+#else
+            printf("[%s] statistics: not collected (build with make STATS=1)\n", name);
+#endif
+        }
+
+    private:
+#ifdef TASKSYS_STATS
+        static void print_line(const char* label, const ThreadStats& stats) {
+            printf("  %-8s %12lld %10.3f %10.3f %10.3f %10lld %10.3f %8lld %8lld %6lld\n", label,
+                   stats.tasks_executed_.load(), stats.busy_ns_.load() / 1e6,
+                   stats.idle_ns_.load() / 1e6, stats.spin_ns_.load() / 1e6,
+                   stats.lock_waits_.load(), stats.lock_wait_ns_.load() / 1e6,
+                   stats.steals_.load(), stats.wakeups_.load(), stats.max_queue_depth_.load());
+        }
+#endif
+
+        const int num_threads_;
+        ThreadStats* threads_;
+};
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef _TASKTRACE_H
+#define _TASKTRACE_H
+
+#include "itasksys.h"
+#include "CycleTimer.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+
+/*
+ * A timeline of task execution in Chrome's Trace Event format, which
+ * Perfetto (ui.perfetto.dev) and chrome://tracing can open:
+ *
+ *  - every task is a slice on the thread that ran it, named after its
+ *    launch;
+ *  - every bulk launch is an async slice from its submission to the end
+ *    of its last task;
+ *  - every dependency between launches is a flow arrow from the last task
+ *    of the prerequisite to the first task of the dependent.
+ *
+ * Each thread of a task system records into its own ring buffer, plus one
+ * buffer shared by all threads outside the pool, without taking any
+ * locks. flush() appends what has been recorded to the file, and may run
+ * while threads are still recording: every slot carries the sequence
+ * number of the event in it, so flush() stops at an event still being
+ * written and skips one overwritten under it. A thread that records more
+ * than a buffer holds between flushes loses its oldest events.
+ *
+ * The file is a JSON array written incrementally. The closing bracket is
+ * only added by the destructor, but the viewers accept a trace without
+ * it, so a trace is readable after every flush.
+ */
+
+class TaskTrace {
+    public:
+        static const int EVENTS_PER_THREAD = 1 << 16;
+
+        TaskTrace(int num_threads, const char* path, const char* process_name)
+            : num_threads_(num_threads), buffers_(new Buffer[num_threads + 1]) {
+            file_ = fopen(path, "w");
+            if (file_ == NULL) {
+                fprintf(stderr, "Could not open trace file %s\n", path);
+                return;
+            }
+            fprintf(file_, "[\n");
+            fprintf(file_, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,"
+                           "\"args\":{\"name\":\"%s\"}}", process_name);
+            for (int i = 0; i <= num_threads; i++) {
+                if (i < num_threads) {
+                    fprintf(file_, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+                                   "\"args\":{\"name\":\"worker %d\"}}", i, i);
+                } else {
+                    fprintf(file_, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+                                   "\"args\":{\"name\":\"caller\"}}", i);
+                }
+            }
+            fflush(file_);
+        }
+
+        ~TaskTrace() {
+            if (file_ != NULL) {
+                flush();
+                fprintf(file_, "\n]\n");
+                fclose(file_);
+            }
+        }
+
+        TaskTrace(const TaskTrace&) = delete;
+        TaskTrace& operator=(const TaskTrace&) = delete;
+
+        bool is_open() const {
+            return file_ != NULL;
+        }
+
+        static double now() {
+            return CycleTimer::currentSeconds();
+        }
+
+        // Thread i is worker i, or any thread outside the pool for
+        // i == num_threads.
+        void task(int thread, TaskID launch, int task_id, double begin, double end) {
+            record(thread, {TASK, launch, task_id, 0, begin, end});
+        }
+
+        void launch_begin(int thread, TaskID launch, int num_total_tasks, double time) {
+            record(thread, {LAUNCH_BEGIN, launch, num_total_tasks, 0, time, time});
+        }
+
+        void launch_end(int thread, TaskID launch, double time) {
+            record(thread, {LAUNCH_END, launch, 0, 0, time, time});
+        }
+
+        // The start of the arrow for prerequisite -> dependent, inside the
+        // task of prerequisite that ended at task_end.
+        void dependency_begin(int thread, TaskID prerequisite, TaskID dependent, double task_end) {
+            record(thread, {FLOW_BEGIN, dependent, 0, prerequisite, task_end, task_end});
+        }
+
+        // The end of the arrow, inside the task of dependent that began at
+        // task_begin.
+        void dependency_end(int thread, TaskID prerequisite, TaskID dependent, double task_begin) {
+            record(thread, {FLOW_END, dependent, 0, prerequisite, task_begin, task_begin});
+        }
+
+        void flush() {
+            std::lock_guard<std::mutex> lock(flush_mtx_);
+            if (file_ == NULL) {
+                return;
+            }
+            for (int i = 0; i <= num_threads_; i++) {
+                Buffer &buffer = buffers_[i];
+                const unsigned long long head = buffer.head.load(std::memory_order_acquire);
+                unsigned long long next = buffer.flushed;
+                unsigned long long dropped = 0;
+                if (head - next > EVENTS_PER_THREAD) {
+                    dropped = head - next - EVENTS_PER_THREAD;
+                    next = head - EVENTS_PER_THREAD;
+                }
+                for (; next < head; next++) {
+                    Event event;
+                    const ReadResult result = read_event(buffer.events[next % EVENTS_PER_THREAD], next, event);
+                    if (result == NOT_WRITTEN) {
+                        // Still being written; picked up by the next flush.
+                        break;
+                    }
+                    if (result == OVERWRITTEN) {
+                        dropped++;
+                        continue;
+                    }
+                    write_event(i, event);
+                }
+                buffer.flushed = next;
+                if (dropped > 0) {
+                    fprintf(stderr, "Trace: thread %d dropped %llu events\n", i, dropped);
+                }
+            }
+            fflush(file_);
+        }
+
+    private:
+        enum EventType {
+            TASK,
+            LAUNCH_BEGIN,
+            LAUNCH_END,
+            FLOW_BEGIN,
+            FLOW_END,
+        };
+
+        struct Event {
+            EventType type;
+            TaskID launch;
+            int value;        // task index, or a launch's task count
+            TaskID other;     // the prerequisite of a flow
+            double begin;
+            double end;
+        };
+
+        /*
+         * One event of a ring buffer, written and read like a seqlock.
+         * Event number n is being written while seq is 2n + 1 and is
+         * complete once it is 2n + 2. The fields are atomics so that
+         * flush() may read them while they are being overwritten; a
+         * field that shows a later event's value also makes that event's
+         * odd seq visible, so the second look at seq catches it.
+         */
+        struct Slot {
+            std::atomic<unsigned long long> seq{0};
+            std::atomic<int> type{0};
+            std::atomic<TaskID> launch{0};
+            std::atomic<int> value{0};
+            std::atomic<TaskID> other{0};
+            std::atomic<double> begin{0};
+            std::atomic<double> end{0};
+        };
+
+        // head counts the events claimed, which flush() reads up to.
+        struct Buffer {
+            std::unique_ptr<Slot[]> events{new Slot[EVENTS_PER_THREAD]};
+            std::atomic<unsigned long long> head{0};
+            unsigned long long flushed = 0;
+            char padding[64]; // keep neighbouring threads' heads apart
+        };
+
+        enum ReadResult {
+            READ,
+            NOT_WRITTEN,
+            OVERWRITTEN,
+        };
+
+        void record(int thread, const Event& event) {
+            // The buffer outside the pool may be shared, so claim a slot
+            // before writing it.
+            Buffer &buffer = buffers_[thread];
+            unsigned long long number;
+            if (thread < num_threads_) {
+                number = buffer.head.load(std::memory_order_relaxed);
+                buffer.head.store(number + 1, std::memory_order_relaxed);
+            } else {
+                number = buffer.head.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            Slot &slot = buffer.events[number % EVENTS_PER_THREAD];
+            slot.seq.store(2 * number + 1, std::memory_order_relaxed);
+            slot.type.store(event.type, std::memory_order_release);
+            slot.launch.store(event.launch, std::memory_order_release);
+            slot.value.store(event.value, std::memory_order_release);
+            slot.other.store(event.other, std::memory_order_release);
+            slot.begin.store(event.begin, std::memory_order_release);
+            slot.end.store(event.end, std::memory_order_release);
+            slot.seq.store(2 * number + 2, std::memory_order_release);
+        }
+
+        // Copies event number out of slot, unless it is not complete yet
+        // or a later event has taken the slot.
+        static ReadResult read_event(const Slot& slot, unsigned long long number, Event& event) {
+            const unsigned long long seq = slot.seq.load(std::memory_order_acquire);
+            if (seq < 2 * number + 2) {
+                return NOT_WRITTEN;
+            }
+            if (seq > 2 * number + 2) {
+                return OVERWRITTEN;
+            }
+            event.type = static_cast<EventType>(slot.type.load(std::memory_order_acquire));
+            event.launch = slot.launch.load(std::memory_order_acquire);
+            event.value = slot.value.load(std::memory_order_acquire);
+            event.other = slot.other.load(std::memory_order_acquire);
+            event.begin = slot.begin.load(std::memory_order_acquire);
+            event.end = slot.end.load(std::memory_order_acquire);
+            return slot.seq.load(std::memory_order_relaxed) == seq ? READ : OVERWRITTEN;
+        }
+
+        // Flow arrows need an ID per edge; TaskIDs are positive ints.
+        static long long flow_id(TaskID prerequisite, TaskID dependent) {
+            return (static_cast<long long>(prerequisite) << 32) | static_cast<unsigned int>(dependent);
+        }
+
+        void write_event(int thread, const Event& event) {
+            // Microseconds, to the nanosecond. Flow ends are nudged just
+            // inside their task so that they attach to it.
+            const double begin_us = event.begin * 1e6;
+            const double end_us = event.end * 1e6;
+            switch (event.type) {
+            case TASK:
+                fprintf(file_, ",\n{\"name\":\"launch %d\",\"cat\":\"task\",\"ph\":\"X\",\"ts\":%.3f,"
+                               "\"dur\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"task\":%d}}",
+                        event.launch, begin_us, end_us - begin_us, thread, event.value);
+                break;
+            case LAUNCH_BEGIN:
+                fprintf(file_, ",\n{\"name\":\"launch %d\",\"cat\":\"launch\",\"ph\":\"b\",\"id\":%d,"
+                               "\"ts\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"tasks\":%d}}",
+                        event.launch, event.launch, begin_us, thread, event.value);
+                break;
+            case LAUNCH_END:
+                fprintf(file_, ",\n{\"name\":\"launch %d\",\"cat\":\"launch\",\"ph\":\"e\",\"id\":%d,"
+                               "\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+                        event.launch, event.launch, begin_us, thread);
+                break;
+            case FLOW_BEGIN:
+                fprintf(file_, ",\n{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"s\",\"id\":%lld,"
+                               "\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+                        flow_id(event.other, event.launch), begin_us - 0.001, thread);
+                break;
+            case FLOW_END:
+                fprintf(file_, ",\n{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"f\",\"bp\":\"e\","
+                               "\"id\":%lld,\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+                        flow_id(event.other, event.launch), begin_us + 0.001, thread);
+                break;
+            }
+        }
+
+        const int num_threads_;
+        std::unique_ptr<Buffer[]> buffers_;
+        FILE *file_ = NULL;
+        std::mutex flush_mtx_;
+};
+
+#endif
@@ -5,6 +5,13 @@
 
 typedef int TaskID;
 
+// The TaskID of a launch that a task system refused to take on because
+// it was overloaded (see backpressure.h). Other TaskIDs are never
+// negative.
+const TaskID REJECTED_TASK = -1;
+
+class TaskGraph;
+
 class IRunnable {
 public:
     virtual ~IRunnable() {}
@@ -19,6 +26,60 @@ public:
     virtual void runTask(int task_id, int num_total_tasks) = 0;
 };
 
+/*
+  How the tasks of a launch are divided among the T threads of a task
+  system, as in OpenMP's schedule clause:
+   - SCHEDULE_DEFAULT: the task system's own choice.
+   - SCHEDULE_STATIC: T contiguous blocks of about num_total_tasks / T
+     tasks, each run as a whole by one thread.
+   - SCHEDULE_STATIC_INTERLEAVED: T blocks, block b being tasks b, b + T,
+     b + 2T, ..., each run as a whole by one thread.
+   - SCHEDULE_DYNAMIC: threads take chunk_size consecutive tasks at a time
+     as they become free.
+   - SCHEDULE_GUIDED: like SCHEDULE_DYNAMIC, but each take is 1/T of the
+     tasks not taken yet, and at least chunk_size.
+ */
+enum SchedulePolicy {
+    SCHEDULE_DEFAULT,
+    SCHEDULE_STATIC,
+    SCHEDULE_STATIC_INTERLEAVED,
+    SCHEDULE_DYNAMIC,
+    SCHEDULE_GUIDED,
+};
+
+/*
+  Optional hints on how to schedule a bulk task launch. A task system is
+  free to ignore any of them.
+   - cache_affinity: task i of this launch works on the same data as task
+     i of earlier launches with the same num_total_tasks, so it should run
+     on the same thread as last time unless that would leave other
+     threads idle.
+   - schedule, chunk_size: see SchedulePolicy. A chunk_size below 1
+     means 1.
+   - deadline: a time on CycleTimer::currentSeconds()'s clock, or 0 for
+     none. Tasks that have not started by then may be skipped, as if the
+     launch had been cancelled at its deadline.
+ */
+struct LaunchHints {
+    bool cache_affinity = false;
+    SchedulePolicy schedule = SCHEDULE_DEFAULT;
+    int chunk_size = 0;
+    double deadline = 0;
+};
+
+/*
+  One bulk task launch of a batch submitted with submitBatch(). It waits
+  for the launches in deps, which were made before the batch, and for the
+  nodes of the batch listed in batch_deps by index. Only nodes that come
+  earlier in the batch count; other entries of batch_deps are ignored.
+ */
+struct BatchNode {
+    IRunnable* runnable;
+    int num_total_tasks;
+    std::vector<TaskID> deps;
+    std::vector<int> batch_deps;
+};
+
 class ITaskSystem {
 public:
     /*
@@ -53,15 +114,166 @@ public:
 
       Returns an identifier that can be used in subsequent calls to
       runAsyncWithDeps() to specify a dependency of some future
-      bulk task launch on this bulk task launch.
+      bulk task launch on this bulk task launch. REJECTED_TASK means that
+      the launch was refused and will not run.
      */
     virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) = 0;
 
+    /*
+      Same as run() and runAsyncWithDeps(), with scheduling hints. The
+      default implementations ignore the hints.
+     */
+    virtual void run(IRunnable* runnable, int num_total_tasks, const LaunchHints& hints) {
+        run(runnable, num_total_tasks);
+    }
+    virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps,
+                                    const LaunchHints& hints) {
+        return runAsyncWithDeps(runnable, num_total_tasks, deps);
+    }
+
+    /*
+      Like runAsyncWithDeps() with the single dependency dep, but at a
+      finer grain: the task indices of both launches are cut into blocks
+      of block_size, and each block of this launch only waits for the
+      same block of dep. dep must have the same num_total_tasks as this
+      launch. These task systems always wait for all of dep.
+     */
+    virtual TaskID runAsyncWithTaskDeps(IRunnable* runnable, int num_total_tasks, TaskID dep, int block_size = 1) {
+        return runAsyncWithDeps(runnable, num_total_tasks, std::vector<TaskID>{dep});
+    }
+
     /*
       Blocks until all tasks created as a result of **any prior**
       runXXX calls are done.
      */
     virtual void sync() = 0;
+
+    /*
+      Blocks until the bulk task launch identified by task_id (and
+      therefore everything it depends on) is done. Other launches
+      may still be running when wait() returns.
+     */
+    virtual void wait(TaskID task_id) {
+        sync();
+    }
+
+    /*
+      Returns whether the bulk task launch identified by task_id is
+      done, without blocking. The default syncs, after which every
+      launch is done.
+     */
+    virtual bool poll(TaskID task_id) {
+        sync();
+        return true;
+    }
+
+    /*
+      Launches a continuation of task_id: like runAsyncWithDeps() with
+      the single dependency task_id, but meant to start on the thread
+      that finishes task_id. The default is runAsyncWithDeps().
+     */
+    virtual TaskID then(TaskID task_id, IRunnable* runnable, int num_total_tasks) {
+        return runAsyncWithDeps(runnable, num_total_tasks, std::vector<TaskID>{task_id});
+    }
+
+    /*
+      Cancels the bulk task launch identified by task_id, and every
+      launch that comes to depend on it before it is done: tasks that
+      have not started are skipped. The default cannot cancel anything.
+     */
+    virtual void cancel(TaskID task_id) {}
+
+    /*
+      Blocks until all of the bulk task launches in task_ids are done.
+     */
+    void wait(const std::vector<TaskID>& task_ids) {
+        for (TaskID task_id : task_ids) {
+            wait(task_id);
+        }
+    }
+
+    /*
+      Launches every bulk task launch of a captured TaskGraph (see
+      taskgraph.h), honoring the dependencies between them. Like
+      runAsyncWithDeps(), this is asynchronous: call sync() to wait for
+      the launches to finish. graph must stay alive until then.
+     */
+    virtual void replay(const TaskGraph& graph);
+
+    /*
+      Launches every node of a batch (see BatchNode) as runAsyncWithDeps()
+      would, and returns their TaskIDs in batch order. The default
+      launches the nodes one by one.
+     */
+    virtual std::vector<TaskID> submitBatch(const std::vector<BatchNode>& nodes);
+
+    /*
+      Prints the runtime statistics the task system has collected since
+      it was created (see taskstats.h) to stdout. The default prints
+      nothing.
+     */
+    virtual void dumpStats() {}
+
+    /*
+      Starts recording a timeline of task execution into a Chrome trace
+      file at path (see tasktrace.h). Call it before launching any work.
+      The default records nothing.
+     */
+    virtual void startTrace(const char* path) {}
+};
+
+/*
+  A handle to an asynchronous bulk task launch: poll it with ready(),
+  block on it with wait(), or chain work after it with then(). It is a
+  TaskID paired with its task system, so copies are cheap and all refer
+  to the same launch.
+ */
+class TaskFuture {
+public:
+    TaskFuture() : system_(nullptr), id_(0) {}
+    TaskFuture(ITaskSystem* system, TaskID task_id) : system_(system), id_(task_id) {}
+
+    TaskID id() const { return id_; }
+    bool ready() const { return system_->poll(id_); }
+    void wait() const { system_->wait(id_); }
+
+    TaskFuture then(IRunnable* runnable, int num_total_tasks) const {
+        return TaskFuture(system_, system_->then(id_, runnable, num_total_tasks));
+    }
+
+private:
+    ITaskSystem *system_;
+    TaskID id_;
 };
 
+#include "taskgraph.h"
+
+inline void ITaskSystem::replay(const TaskGraph& graph) {
+    std::vector<TaskID> task_ids(graph.size());
+    std::vector<TaskID> deps;
+    for (int i = 0; i < graph.size(); i++) {
+        const TaskGraph::Node& node = graph.node(i);
+        deps.assign(graph.dependencies(i), graph.dependencies(i) + node.num_dependencies);
+        for (TaskID& dep : deps) {
+            dep = task_ids[dep];
+        }
+        task_ids[i] = runAsyncWithDeps(node.runnable, node.num_total_tasks, deps);
+    }
+}
+
+inline std::vector<TaskID> ITaskSystem::submitBatch(const std::vector<BatchNode>& nodes) {
+    std::vector<TaskID> task_ids(nodes.size());
+    std::vector<TaskID> deps;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        deps = nodes[i].deps;
+        for (int dep : nodes[i].batch_deps) {
+            if (dep >= 0 && static_cast<size_t>(dep) < i) {
+                deps.push_back(task_ids[dep]);
+            }
+        }
+        task_ids[i] = runAsyncWithDeps(nodes[i].runnable, nodes[i].num_total_tasks, deps);
+    }
+    return task_ids;
+}
+
 #endif
@@ -1,4 +1,34 @@
 #include "tasksys.h"
+#include "CycleTimer.h"
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+// First task of block b when num_total_tasks are cut into num_blocks
+// contiguous blocks of nearly equal size.
+inline int block_begin(const int num_total_tasks, const int block, const int num_blocks) {
+    return static_cast<int>(static_cast<long long>(num_total_tasks) * block / num_blocks);
+}
+
+// How many tasks a thread takes at once under SCHEDULE_DYNAMIC or
+// SCHEDULE_GUIDED, with num_remaining tasks not taken yet.
+inline int chunk_to_take(const SchedulePolicy schedule, const int chunk_size, const int num_remaining,
+                         const int num_threads) {
+    int chunk = std::max(1, chunk_size);
+    if (schedule == SCHEDULE_GUIDED) {
+        chunk = std::max(chunk, num_remaining / num_threads);
+    }
+    return std::min(chunk, num_remaining);
+}
+
+// Only compact and scatter placement need the machine's topology.
+std::vector<int> place_workers(const ThreadPlacement& placement, const int num_threads) {
+    const bool needs_topology = placement.policy == PLACEMENT_COMPACT || placement.policy == PLACEMENT_SCATTER;
+    return place_threads(placement, num_threads, needs_topology ? read_cpu_topology() : std::vector<CpuInfo>());
+}
+
+}
 
 // =================================================================
 // SERIAL IMPLEMENTATION
@@ -46,15 +76,37 @@ TaskSystemParallelSpawn::~TaskSystemParallelSpawn() {
 }
 
 void TaskSystemParallelSpawn::run(IRunnable* runnable, const int num_total_tasks) {
-    const int tasks_per_thread = (num_total_tasks + num_threads - 1) / num_threads;
+    run(runnable, num_total_tasks, LaunchHints());
+}
 
-    for (int i = 0; i < num_threads; i++) {
-        const int start_task = i * tasks_per_thread;
-        const int end_task = std::min((i + 1) * tasks_per_thread, num_total_tasks);
+void TaskSystemParallelSpawn::run(IRunnable* runnable, const int num_total_tasks, const LaunchHints& hints) {
+    const SchedulePolicy schedule = hints.schedule;
+    const int chunk_size = hints.chunk_size;
+    std::atomic<int> next_task{0};
 
-        threads[i] = new std::thread([runnable, start_task, end_task, num_total_tasks] {
-            for (int j = start_task; j < end_task; ++j) {
-                runnable->runTask(j, num_total_tasks);
+    for (int i = 0; i < num_threads; i++) {
+        threads[i] = new std::thread([this, runnable, num_total_tasks, schedule, chunk_size, &next_task, i] {
+            if (schedule == SCHEDULE_DYNAMIC || schedule == SCHEDULE_GUIDED) {
+                int begin = next_task.load();
+                while (begin < num_total_tasks) {
+                    const int end = begin + chunk_to_take(schedule, chunk_size, num_total_tasks - begin, num_threads);
+                    if (next_task.compare_exchange_weak(begin, end)) {
+                        for (int j = begin; j < end; ++j) {
+                            runnable->runTask(j, num_total_tasks);
+                        }
+                        begin = next_task.load();
+                    }
+                }
+            } else if (schedule == SCHEDULE_STATIC_INTERLEAVED) {
+                for (int j = i; j < num_total_tasks; j += num_threads) {
+                    runnable->runTask(j, num_total_tasks);
+                }
+            } else {
+                // One contiguous block per thread, which is also the default.
+                const int end_task = block_begin(num_total_tasks, i + 1, num_threads);
+                for (int j = block_begin(num_total_tasks, i, num_threads); j < end_task; ++j) {
+                    runnable->runTask(j, num_total_tasks);
+                }
             }
         });
     }
@@ -82,59 +134,187 @@ const char* TaskSystemParallelThreadPoolSpinning::name() {
     return "Parallel + Thread Pool + Spin";
 }
 
-TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(const int num_threads)
+TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(const int num_threads,
+                                                                           const ThreadPlacement& placement,
+                                                                           const ElasticBounds& bounds)
     : ITaskSystem(num_threads)
     , num_threads(num_threads)
+    , elastic(clamp_bounds(bounds, num_threads))
+    , worker_cpus(place_workers(placement, num_threads))
+    , task_stats(num_threads)
+    , worker_live(num_threads, false)
 {
-    threads = new std::thread *[num_threads];
+    threads = new std::thread *[num_threads]();
+    start_workers(elastic.enabled() ? elastic.min_threads : num_threads);
+}
+
+TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {
+    stop.store(true);
 
     for (int i = 0; i < num_threads; ++i) {
-        threads[i] = new std::thread([this] {
-            while (!stop.load()) {
-                int task_id = -1;
-
-                {
-                    std::unique_lock<std::mutex> lock(mtx);
-                    if (!tasks.empty()) {
-                        task_id = tasks.front();
-                        tasks.pop();
-                    }
-                }
+        if (threads[i] != nullptr && threads[i]->joinable()) {
+            threads[i]->join();
+        }
+        delete threads[i];
+    }
+    delete[] threads;
+}
 
-                if (task_id != -1) {
-                    current_runnable->runTask(task_id, current_num_total_tasks);
-                    tasks_completed.fetch_add(1);
+void TaskSystemParallelThreadPoolSpinning::worker_loop(const int worker_id) {
+    ThreadStats &stats = task_stats.thread(worker_id);
+    double idle_since = 0;
+    while (!stop.load()) {
+        const double poll_start = stats_clock();
+        if (run_next_task(stats)) {
+            idle_since = 0;
+            continue;
+        }
+        // Let the thread calling run() have the core if it shares one
+        // with us.
+        std::this_thread::yield();
+        stats.add_spin(stats_clock() - poll_start);
+
+        if (elastic.enabled()) {
+            const double now = CycleTimer::currentSeconds();
+            if (idle_since == 0) {
+                idle_since = now;
+            } else if (now - idle_since >= elastic.retire_after) {
+                // Idle for retire_after: leave it to run() to start this
+                // worker again.
+                std::lock_guard<std::mutex> lock(workers_mtx);
+                if (num_live.load() > elastic.min_threads) {
+                    worker_live[worker_id] = false;
+                    num_live.fetch_sub(1);
+                    return;
                 }
+                idle_since = now;
             }
-        });
+        }
     }
 }
 
-TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {
-    stop.store(true);
+/*
+ * Starts up to count workers that are not running. Only run() and the
+ * constructor call it, one at a time. The thread of a retired worker is
+ * joined before the worker is started again, without holding
+ * workers_mtx, which the retiring thread may still need.
+ */
+void TaskSystemParallelThreadPoolSpinning::start_workers(int count) {
+    std::vector<int> starting;
+    {
+        std::lock_guard<std::mutex> lock(workers_mtx);
+        for (int i = 0; i < num_threads && count > 0; ++i) {
+            if (!worker_live[i]) {
+                worker_live[i] = true;
+                num_live.fetch_add(1);
+                starting.push_back(i);
+                count--;
+            }
+        }
+    }
 
-    for (int i = 0; i < num_threads; ++i) {
-        if (threads[i]->joinable()) {
+    for (const int i : starting) {
+        if (threads[i] != nullptr) {
             threads[i]->join();
+            delete threads[i];
         }
-        delete threads[i];
+        const int cpu = worker_cpus[i];
+        threads[i] = new std::thread([this, i, cpu] {
+            pin_current_thread(cpu);
+            worker_loop(i);
+        });
     }
-    delete[] threads;
+}
+
+namespace {
+
+const unsigned long long TASK_INDEX_MASK = 0xffffffffull;
+// The task index of a launch that is being replaced.
+const unsigned long long CLOSED_LAUNCH = TASK_INDEX_MASK;
+
 }
 
 void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, const int num_total_tasks) {
-    current_runnable = runnable;
-    current_num_total_tasks = num_total_tasks;
+    run(runnable, num_total_tasks, LaunchHints());
+}
+
+void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, const int num_total_tasks,
+                                               const LaunchHints& hints) {
+    ThreadStats &stats = task_stats.thread(num_threads);
+
+    const unsigned long long epoch = (launch_state.load() >> 32) + 1;
+    launch_state.store((epoch << 32) | CLOSED_LAUNCH);
+    current_runnable.store(runnable);
+    current_num_total_tasks.store(num_total_tasks);
+    current_schedule.store(hints.schedule);
+    // Without a schedule, tasks are handed out one at a time.
+    current_chunk_size.store(hints.schedule == SCHEDULE_DEFAULT ? 1 : hints.chunk_size);
     tasks_completed.store(0);
+    launch_state.store(epoch << 32);
+    stats.note_queue_depth(num_total_tasks);
 
-    {
-        std::unique_lock<std::mutex> lock(mtx);
-        for (int i = 0; i < num_total_tasks; ++i) {
-            tasks.push(i);
-        }
+    // Bring back retired workers for the launch. One that retires from
+    // here on just leaves its share to the others and to us.
+    if (num_live.load() < num_threads) {
+        start_workers(num_total_tasks);
     }
 
+    // Help out instead of just spinning until the workers are done.
     while (tasks_completed.load() < num_total_tasks) {
+        const double poll_start = stats_clock();
+        if (!run_next_task(stats)) {
+            stats.add_spin(stats_clock() - poll_start);
+        }
+    }
+}
+
+bool TaskSystemParallelThreadPoolSpinning::run_next_task(ThreadStats& stats) {
+    unsigned long long state = launch_state.load();
+    while (true) {
+        const unsigned long long claimed = state & TASK_INDEX_MASK;
+        if (claimed == CLOSED_LAUNCH) {
+            return false;
+        }
+
+        // These may already belong to the next launch, in which case the
+        // epoch has moved on and the claim below fails.
+        IRunnable *runnable = current_runnable.load();
+        const int num_total_tasks = current_num_total_tasks.load();
+        const SchedulePolicy schedule = current_schedule.load();
+        const int chunk_size = current_chunk_size.load();
+
+        // The static schedules hand out whole blocks.
+        const bool by_block = schedule == SCHEDULE_STATIC || schedule == SCHEDULE_STATIC_INTERLEAVED;
+        const int num_claims = by_block ? std::min(num_threads, num_total_tasks) : num_total_tasks;
+        if (claimed >= static_cast<unsigned long long>(num_claims)) {
+            return false;
+        }
+        const int first = static_cast<int>(claimed);
+        const int take = by_block ? 1 : chunk_to_take(schedule, chunk_size, num_total_tasks - first, num_threads);
+
+        if (launch_state.compare_exchange_weak(state, state + take)) {
+            int begin = first;
+            int end = first + take;
+            int stride = 1;
+            if (schedule == SCHEDULE_STATIC) {
+                begin = block_begin(num_total_tasks, first, num_claims);
+                end = block_begin(num_total_tasks, first + 1, num_claims);
+            } else if (schedule == SCHEDULE_STATIC_INTERLEAVED) {
+                end = num_total_tasks;
+                stride = num_claims;
+            }
+
+            const double start = stats_clock();
+            int count = 0;
+            for (int i = begin; i < end; i += stride) {
+                runnable->runTask(i, num_total_tasks);
+                ++count;
+            }
+            stats.add_busy(stats_clock() - start);
+            stats.count_tasks(count);
+            tasks_completed.fetch_add(count);
+            return true;
+        }
     }
 }
 
@@ -150,6 +330,10 @@ void TaskSystemParallelThreadPoolSpinning::sync() {
     return;
 }
 
+void TaskSystemParallelThreadPoolSpinning::dumpStats() {
+    task_stats.dump(name());
+}
+
 // =================================================================
 // PARALLEL THREAD POOL SLEEPING TASK SYSTEM IMPLEMENTATION
 // =================================================================
@@ -158,38 +342,21 @@ const char* TaskSystemParallelThreadPoolSleeping::name() {
     return "Parallel + Thread Pool + Sleep";
 }
 
-TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(const int num_threads)
+TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(const int num_threads,
+                                                                           const ThreadPlacement& placement,
+                                                                           const ElasticBounds& bounds,
+                                                                           const SubmissionLimits& limits)
     : ITaskSystem(num_threads)
     , num_threads(num_threads)
+    , elastic(clamp_bounds(bounds, num_threads))
+    , limits(limits)
+    , worker_cpus(place_workers(placement, num_threads))
+    , task_stats(num_threads)
+    , worker_live(num_threads, false)
 {
-    threads = new std::thread *[num_threads];
-    for (int i = 0; i < num_threads; ++i) {
-        threads[i] = new std::thread([this] {
-            while (true) {
-                std::function<void()> task_to_run;
-                {
-                    std::unique_lock<std::mutex> lock(mtx);
-
-                    cv.wait(lock, [this] {
-                        return stop || !tasks.empty();
-                    });
-
-                    if (stop && tasks.empty()) {
-                        return;
-                    }
-
-                    if (tasks.empty()) {
-                        continue;
-                    }
-
-                    task_to_run = tasks.front();
-                    tasks.pop();
-                }
-
-                task_to_run();
-            }
-        });
-    }
+    threads = new std::thread *[num_threads]();
+    std::unique_lock<std::mutex> lock(mtx);
+    start_workers(elastic.enabled() ? elastic.min_threads : num_threads);
 }
 
 TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
@@ -200,26 +367,182 @@ TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
     cv.notify_all();
 
     for (int i = 0; i < num_threads; ++i) {
-        if (threads[i]->joinable()) {
+        if (threads[i] != nullptr && threads[i]->joinable()) {
             threads[i]->join();
         }
         delete threads[i];
     }
     delete[] threads;
+    join_retired();
+}
+
+void TaskSystemParallelThreadPoolSleeping::worker_loop(const int worker_id) {
+    ThreadStats &stats = task_stats.thread(worker_id);
+    while (true) {
+        std::function<int()> task_to_run;
+        {
+            std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+            lock_counted(lock, stats);
+
+            if (!stop && tasks.empty()) {
+                const double park_start = stats_clock();
+                const auto has_work = [this] {
+                    return stop || !tasks.empty();
+                };
+                bool woken = true;
+                num_waiting++;
+                if (elastic.enabled()) {
+                    woken = cv.wait_for(lock, std::chrono::duration<double>(elastic.retire_after), has_work);
+                } else {
+                    cv.wait(lock, has_work);
+                }
+                num_waiting--;
+                stats.add_idle(stats_clock() - park_start);
+
+                // Idle for retire_after: leave it to run() to start this
+                // worker again once there is more work.
+                if (!woken && num_live > elastic.min_threads) {
+                    worker_live[worker_id] = false;
+                    num_live--;
+                    return;
+                }
+                stats.count_wakeup();
+            }
+
+            if (stop && tasks.empty()) {
+                return;
+            }
+
+            if (tasks.empty()) {
+                continue;
+            }
+
+            task_to_run = tasks.front();
+            tasks.pop();
+            if (room_waiter) {
+                room_cv.notify_one();
+            }
+        }
+
+        const double start = stats_clock();
+        const int count = task_to_run();
+        stats.add_busy(stats_clock() - start);
+        stats.count_tasks(count);
+    }
+}
+
+// Starts up to count workers that are not running. Called with mtx held,
+// so the threads of retired workers are left in retired_threads for
+// join_retired() to join once it is let go.
+void TaskSystemParallelThreadPoolSleeping::start_workers(int count) {
+    for (int i = 0; i < num_threads && count > 0; ++i) {
+        if (worker_live[i]) {
+            continue;
+        }
+        if (threads[i] != nullptr) {
+            retired_threads.push_back(threads[i]);
+        }
+        worker_live[i] = true;
+        num_live++;
+        count--;
+
+        const int cpu = worker_cpus[i];
+        threads[i] = new std::thread([this, i, cpu] {
+            pin_current_thread(cpu);
+            worker_loop(i);
+        });
+    }
+}
+
+// Joins the threads start_workers() replaced. Called without mtx.
+void TaskSystemParallelThreadPoolSleeping::join_retired() {
+    std::vector<std::thread*> retired;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        retired.swap(retired_threads);
+    }
+    for (std::thread *thread : retired) {
+        thread->join();
+        delete thread;
+    }
 }
 
 void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, const int num_total_tasks) {
-    for (int i = 0; i < num_total_tasks; i++) {
-        auto work_item = [runnable, i, num_total_tasks] {
-            runnable->runTask(i, num_total_tasks);
-        };
+    run(runnable, num_total_tasks, LaunchHints());
+}
 
-        std::unique_lock<std::mutex> lock(mtx);
-        tasks.push(work_item);
-        lock.unlock();
+void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, const int num_total_tasks,
+                                               const LaunchHints& hints) {
+    ThreadStats &stats = task_stats.thread(num_threads);
+    {
+        std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+        lock_counted(lock, stats);
+        tasks_remaining = num_total_tasks;
+
+        // The static schedules queue one entry per block, dynamic and
+        // guided ones an entry per chunk, and by default every task is
+        // queued on its own.
+        const int num_blocks = std::min(num_threads, num_total_tasks);
+        if (hints.schedule == SCHEDULE_STATIC) {
+            for (int b = 0; b < num_blocks; b++) {
+                queue_tasks(lock, runnable, num_total_tasks, block_begin(num_total_tasks, b, num_blocks),
+                            block_begin(num_total_tasks, b + 1, num_blocks), 1);
+            }
+        } else if (hints.schedule == SCHEDULE_STATIC_INTERLEAVED) {
+            for (int b = 0; b < num_blocks; b++) {
+                queue_tasks(lock, runnable, num_total_tasks, b, num_total_tasks, num_blocks);
+            }
+        } else if (hints.schedule == SCHEDULE_DYNAMIC || hints.schedule == SCHEDULE_GUIDED) {
+            int begin = 0;
+            while (begin < num_total_tasks) {
+                const int take = chunk_to_take(hints.schedule, hints.chunk_size, num_total_tasks - begin,
+                                               num_threads);
+                queue_tasks(lock, runnable, num_total_tasks, begin, begin + take, 1);
+                begin += take;
+            }
+        } else {
+            for (int i = 0; i < num_total_tasks; i++) {
+                queue_tasks(lock, runnable, num_total_tasks, i, i + 1, 1);
+            }
+        }
+        stats.note_queue_depth(tasks.size());
+
+        // Start retired workers for the entries no waiting worker will
+        // take.
+        if (num_live < num_threads) {
+            start_workers(static_cast<int>(tasks.size()) - num_waiting);
+        }
+    }
+    cv.notify_all();
+    join_retired();
+
+    // Run queued tasks on the calling thread too, then wait for whatever
+    // the workers still have in flight.
+    while (true) {
+        std::function<int()> task_to_run;
+        {
+            std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+            lock_counted(lock, stats);
+            if (tasks.empty()) {
+                break;
+            }
+            task_to_run = tasks.front();
+            tasks.pop();
+        }
 
-        cv.notify_one();
+        const double start = stats_clock();
+        const int count = task_to_run();
+        stats.add_busy(stats_clock() - start);
+        stats.count_tasks(count);
     }
+
+    std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+    lock_counted(lock, stats);
+    const double park_start = stats_clock();
+    done_cv.wait(lock, [this] {
+        return tasks_remaining == 0;
+    });
+    stats.add_idle(stats_clock() - park_start);
 }
 
 TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
@@ -241,3 +564,71 @@ void TaskSystemParallelThreadPoolSleeping::sync() {
 
     return;
 }
+
+// Queues an entry that runs tasks begin, begin + stride, ... below end.
+// Called with mtx held through lock, which make_room() may let go.
+void TaskSystemParallelThreadPoolSleeping::queue_tasks(std::unique_lock<std::mutex>& lock, IRunnable* runnable,
+                                                       const int num_total_tasks, const int begin, const int end,
+                                                       const int stride) {
+    if (queue_full()) {
+        make_room(lock);
+    }
+    tasks.push([this, runnable, num_total_tasks, begin, end, stride] {
+        int count = 0;
+        for (int i = begin; i < end; i += stride) {
+            runnable->runTask(i, num_total_tasks);
+            ++count;
+        }
+
+        std::unique_lock<std::mutex> lock(mtx);
+        tasks_remaining -= count;
+        if (tasks_remaining == 0) {
+            done_cv.notify_all();
+        }
+        return count;
+    });
+}
+
+/*
+ * Waits for the queue to drop below limits.max_tasks entries, with mtx
+ * held through lock. The workers are woken for what is queued so far,
+ * and then either take entries off the queue while run() sleeps or, when
+ * the policy is to help, share them with run().
+ */
+void TaskSystemParallelThreadPoolSleeping::make_room(std::unique_lock<std::mutex>& lock) {
+    if (num_live < num_threads) {
+        start_workers(static_cast<int>(tasks.size()) - num_waiting);
+    }
+    cv.notify_all();
+
+    ThreadStats &stats = task_stats.thread(num_threads);
+    while (queue_full()) {
+        if (limits.policy == OVERLOAD_BLOCK) {
+            const double park_start = stats_clock();
+            room_waiter = true;
+            room_cv.wait(lock, [this] {
+                return !queue_full();
+            });
+            room_waiter = false;
+            stats.add_idle(stats_clock() - park_start);
+            break;
+        }
+
+        std::function<int()> task_to_run = tasks.front();
+        tasks.pop();
+        lock.unlock();
+        const double start = stats_clock();
+        const int count = task_to_run();
+        stats.add_busy(stats_clock() - start);
+        stats.count_tasks(count);
+        lock.lock();
+    }
+}
+
+bool TaskSystemParallelThreadPoolSleeping::queue_full() const {
+    return limits.max_tasks > 0 && tasks.size() >= static_cast<size_t>(limits.max_tasks);
+}
+
+void TaskSystemParallelThreadPoolSleeping::dumpStats() {
+    task_stats.dump(name());
+}
@@ -2,6 +2,10 @@
 #define _TASKSYS_H
 
 #include "itasksys.h"
+#include "taskstats.h"
+#include "cputopology.h"
+#include "elastic.h"
+#include "backpressure.h"
 #include <thread>
 #include <queue>
 #include <mutex>
@@ -27,6 +31,7 @@ public:
 
     const char* name() override;
     void run(IRunnable* runnable, int num_total_tasks) override;
+    void run(IRunnable* runnable, int num_total_tasks, const LaunchHints& hints) override;
     TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) override;
     void sync() override;
 
@@ -37,47 +42,118 @@ private:
 
 class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
 public:
-    explicit TaskSystemParallelThreadPoolSpinning(int num_threads);
+    // Workers are pinned to CPUs according to placement (see cputopology.h).
+    // In an elastic pool (see elastic.h) only min_threads workers keep
+    // spinning between launches: the others exit once they have found no
+    // work for retire_after seconds, and run() starts them again.
+    explicit TaskSystemParallelThreadPoolSpinning(int num_threads,
+                                                  const ThreadPlacement& placement = ThreadPlacement(),
+                                                  const ElasticBounds& bounds = ElasticBounds());
     ~TaskSystemParallelThreadPoolSpinning() override;
 
     const char* name() override;
     void run(IRunnable* runnable, int num_total_tasks) override;
+    void run(IRunnable* runnable, int num_total_tasks, const LaunchHints& hints) override;
     TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) override;
     void sync() override;
+    void dumpStats() override;
 
 private:
+    bool run_next_task(ThreadStats& stats);
+    void worker_loop(int worker_id);
+    void start_workers(int count);
+
     std::thread **threads;
     const int num_threads;
-
-    IRunnable *current_runnable;
-    int current_num_total_tasks;
-
-    std::queue<int> tasks;
-    std::mutex mtx;
-
+    const ElasticBounds elastic;
+    std::vector<int> worker_cpus;
+    TaskStats task_stats;
+
+    // A retiring worker clears its worker_live entry under workers_mtx;
+    // its thread is joined when start_workers() reuses the slot.
+    std::mutex workers_mtx;
+    std::vector<bool> worker_live;
+    std::atomic<int> num_live{0};
+
+    /*
+     * The current launch is claimed through launch_state, which holds the
+     * launch's epoch in its high half and the next unclaimed task index
+     * (or block index, under the static schedules) in its low half, so
+     * that workers never take a lock. A claim is a CAS
+     * that only succeeds while the epoch is unchanged, and run() closes
+     * the old epoch before replacing the runnable, so a worker that raced
+     * with the start of a new launch can never run a task of the old
+     * launch with the new runnable.
+     */
+    std::atomic<IRunnable*> current_runnable{nullptr};
+    std::atomic<int> current_num_total_tasks{0};
+    std::atomic<SchedulePolicy> current_schedule{SCHEDULE_DEFAULT};
+    std::atomic<int> current_chunk_size{1};
+    std::atomic<unsigned long long> launch_state{0};
+    char padding0[56]; // keep the claimed index and the completion count apart
     std::atomic<int> tasks_completed{0};
+    char padding1[60];
     std::atomic<bool> stop{false};
 };
 
 class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
 public:
-    explicit TaskSystemParallelThreadPoolSleeping(int num_threads);
+    // Workers are pinned to CPUs according to placement (see cputopology.h),
+    // and come and go between min and num_threads under bounds (see
+    // elastic.h). Of limits (see backpressure.h), only max_tasks applies
+    // here: it caps the entries waiting in the queue. run() cannot refuse
+    // a launch, so OVERLOAD_REJECT helps like OVERLOAD_HELP.
+    explicit TaskSystemParallelThreadPoolSleeping(int num_threads,
+                                                  const ThreadPlacement& placement = ThreadPlacement(),
+                                                  const ElasticBounds& bounds = ElasticBounds(),
+                                                  const SubmissionLimits& limits = SubmissionLimits());
     ~TaskSystemParallelThreadPoolSleeping() override;
 
     const char* name() override;
     void run(IRunnable* runnable, int num_total_tasks) override;
+    void run(IRunnable* runnable, int num_total_tasks, const LaunchHints& hints) override;
     TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) override;
     void sync() override;
+    void dumpStats() override;
 
 private:
+    void queue_tasks(std::unique_lock<std::mutex>& lock, IRunnable* runnable, int num_total_tasks,
+                     int begin, int end, int stride);
+    void make_room(std::unique_lock<std::mutex>& lock);
+    bool queue_full() const;
+    void worker_loop(int worker_id);
+    void start_workers(int count);
+    void join_retired();
+
     std::thread **threads;
     const int num_threads;
+    const ElasticBounds elastic;
+    const SubmissionLimits limits;
+    std::vector<int> worker_cpus;
+    TaskStats task_stats;
 
-    std::queue<std::function<void()>> tasks;
+    // Each entry runs some tasks of the current launch and returns how many.
+    std::queue<std::function<int()>> tasks;
     std::mutex mtx;
 
     std::condition_variable cv;
     bool stop = false;
+
+    // Guarded by mtx, like the queue. A retired worker clears its
+    // worker_live entry; its thread is joined, outside mtx, after the
+    // slot is reused.
+    std::vector<bool> worker_live;
+    std::vector<std::thread*> retired_threads;
+    int num_live = 0;
+    int num_waiting = 0;
+
+    int tasks_remaining = 0;
+    std::condition_variable done_cv;
+
+    // run() waits on room_cv, under OVERLOAD_BLOCK, for workers to take
+    // entries off a full queue.
+    bool room_waiter = false;
+    std::condition_variable room_cv;
 };
 
 #endif
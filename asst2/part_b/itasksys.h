@@ -4,6 +4,13 @@
 
 typedef int TaskID;
 
+// The TaskID of a launch that a task system refused to take on because
+// it was overloaded (see backpressure.h). Other TaskIDs are never
+// negative.
+const TaskID REJECTED_TASK = -1;
+
+class TaskGraph;
+
 class IRunnable {
     public:
         virtual ~IRunnable();
@@ -20,6 +27,63 @@ class IRunnable {
         virtual void runTask(int task_id, int num_total_tasks) = 0;
 };
 
+/*
+  How the tasks of a launch are divided among the T threads of a task
+  system, as in OpenMP's schedule clause:
+
+   - SCHEDULE_DEFAULT: the task system's own choice.
+   - SCHEDULE_STATIC: T contiguous blocks of about num_total_tasks / T
+     tasks, each run as a whole by one thread.
+   - SCHEDULE_STATIC_INTERLEAVED: T blocks, block b being tasks b,
+     b + T, b + 2T, ..., each run as a whole by one thread.
+   - SCHEDULE_DYNAMIC: threads take chunk_size consecutive tasks at a
+     time as they become free.
+   - SCHEDULE_GUIDED: like SCHEDULE_DYNAMIC, but each take is 1/T of
+     the tasks not taken yet, and at least chunk_size.
+ */
+enum SchedulePolicy {
+    SCHEDULE_DEFAULT,
+    SCHEDULE_STATIC,
+    SCHEDULE_STATIC_INTERLEAVED,
+    SCHEDULE_DYNAMIC,
+    SCHEDULE_GUIDED,
+};
+
+/*
+  Optional hints on how to schedule a bulk task launch. A task system
+  is free to ignore any of them.
+
+   - cache_affinity: task i of this launch works on the same data as
+     task i of earlier launches with the same num_total_tasks, so it
+     should run on the same thread as last time unless that would
+     leave other threads idle.
+   - schedule, chunk_size: see SchedulePolicy. A chunk_size below 1
+     means 1.
+   - deadline: a time on CycleTimer::currentSeconds()'s clock, or 0
+     for none. Tasks that have not started by then are skipped, as
+     if the launch had been cancelled at its deadline (see cancel()).
+ */
+struct LaunchHints {
+    bool cache_affinity = false;
+    SchedulePolicy schedule = SCHEDULE_DEFAULT;
+    int chunk_size = 0;
+    double deadline = 0;
+};
+
+/*
+  One bulk task launch of a batch submitted with submitBatch(). It
+  waits for the launches in deps, which were made before the batch,
+  and for the nodes of the batch listed in batch_deps by index. Only
+  nodes that come earlier in the batch count; other entries of
+  batch_deps are ignored.
+ */
+struct BatchNode {
+    IRunnable* runnable;
+    int num_total_tasks;
+    std::vector<TaskID> deps;
+    std::vector<int> batch_deps;
+};
+
 class ITaskSystem {
     public:
         /*
@@ -56,14 +120,163 @@ class ITaskSystem {
           Returns an identifier that can be used in subsequent calls to
           runAsyncWithDeps() to specify a dependency of some future
           bulk task launch on this bulk task launch.
+          REJECTED_TASK means that the launch was refused and will
+          not run.
          */
         virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                         const std::vector<TaskID>& deps) = 0;
 
+        /*
+          Same as run() and runAsyncWithDeps(), with scheduling hints.
+          The default implementations ignore the hints.
+         */
+        virtual void run(IRunnable* runnable, int num_total_tasks,
+                         const LaunchHints& hints);
+        virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                        const std::vector<TaskID>& deps,
+                                        const LaunchHints& hints);
+
+        /*
+          Like runAsyncWithDeps() with the single dependency dep, but
+          at a finer grain: the task indices of both launches are cut
+          into blocks of block_size, and each block of this launch
+          only waits for the same block of dep. With the default
+          block_size of 1, task i waits for task i of dep alone. This
+          lets a chain of elementwise launches run as a pipeline.
+
+          dep must have the same num_total_tasks as this launch; if it
+          does not, this launch waits for all of dep instead.
+
+          The default implementation always waits for all of dep.
+         */
+        virtual TaskID runAsyncWithTaskDeps(IRunnable* runnable, int num_total_tasks,
+                                            TaskID dep, int block_size = 1);
+
         /*
           Blocks until all tasks created as a result of **any prior**
           runXXX calls are done.
+
+          Called from inside runTask(), where the calling task's own
+          launch cannot be done yet, it only waits for the launches made
+          by the calling task.
          */
         virtual void sync() = 0;
+
+        /*
+          Blocks until the bulk task launch identified by task_id (and
+          therefore everything it depends on) is done. Other launches
+          may still be running when wait() returns.
+
+          The default implementation falls back to sync().
+         */
+        virtual void wait(TaskID task_id);
+
+        /*
+          Returns whether the bulk task launch identified by task_id is
+          done, without blocking.
+
+          The default implementation falls back to sync(), after which
+          every launch is done.
+         */
+        virtual bool poll(TaskID task_id);
+
+        /*
+          Launches a continuation of task_id: like runAsyncWithDeps()
+          with the single dependency task_id, but the continuation
+          starts on the thread that finishes the last task of task_id,
+          without going through the task queue first.
+
+          The default implementation is runAsyncWithDeps().
+         */
+        virtual TaskID then(TaskID task_id, IRunnable* runnable, int num_total_tasks);
+
+        /*
+          Cancels the bulk task launch identified by task_id, and with
+          it every launch that comes to depend on it before it is done,
+          including then() continuations and runAsyncWithTaskDeps()
+          launches whose first blocks are already running.
+          Tasks that have not started are skipped; tasks already
+          running finish. A cancelled launch is still done, as far as
+          wait(), poll() and sync() are concerned, once its own
+          dependencies are done and its running tasks have returned.
+          Cancelling a launch that is already done has no effect.
+
+          The default implementation cannot cancel anything.
+         */
+        virtual void cancel(TaskID task_id);
+
+        /*
+          Blocks until all of the bulk task launches in task_ids are
+          done.
+         */
+        void wait(const std::vector<TaskID>& task_ids);
+
+        /*
+          Launches every bulk task launch of a captured TaskGraph (see
+          taskgraph.h), honoring the dependencies between them. Like
+          runAsyncWithDeps(), this is asynchronous: call sync() to wait
+          for the launches to finish. graph must stay alive until then.
+
+          The default implementation issues the launches one by one
+          through runAsyncWithDeps().
+         */
+        virtual void replay(const TaskGraph& graph);
+
+        /*
+          Launches every node of a batch (see BatchNode) as
+          runAsyncWithDeps() would, and returns their TaskIDs in batch
+          order. Unlike a loop over runAsyncWithDeps(), the whole batch
+          can be wired up before any of it is released, and its ready
+          nodes queued together.
+
+          The default implementation launches the nodes one by one
+          through runAsyncWithDeps().
+         */
+        virtual std::vector<TaskID> submitBatch(const std::vector<BatchNode>& nodes);
+
+        /*
+          Prints the runtime statistics the task system has collected
+          since it was created (see taskstats.h) to stdout.
+
+          The default implementation prints nothing.
+         */
+        virtual void dumpStats();
+
+        /*
+          Starts recording a timeline of task execution into a Chrome
+          trace file at path (see tasktrace.h), written out by sync()
+          and when the task system is destroyed. Call it before
+          launching any work.
+
+          The default implementation records nothing.
+         */
+        virtual void startTrace(const char* path);
 };
+
+/*
+  A handle to an asynchronous bulk task launch: poll it with ready(),
+  block on it with wait(), or chain work after it with then(). It is a
+  TaskID paired with its task system, so copies are cheap and all refer
+  to the same launch.
+ */
+class TaskFuture {
+    public:
+        TaskFuture(): system_(nullptr), id_(0) {}
+        TaskFuture(ITaskSystem* system, TaskID task_id): system_(system), id_(task_id) {}
+
+        TaskID id() const { return id_; }
+        bool ready() const { return system_->poll(id_); }
+        void wait() const { system_->wait(id_); }
+
+        TaskFuture then(IRunnable* runnable, int num_total_tasks) const {
+            return TaskFuture(system_, system_->then(id_, runnable, num_total_tasks));
+        }
+
+    private:
+        ITaskSystem *system_;
+        TaskID id_;
+};
+
+#include "taskgraph.h"
+
 #endif
@@ -1,4 +1,8 @@
 #include "tasksys.h"
+#include "CycleTimer.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
 
 
 IRunnable::~IRunnable() {}
@@ -6,6 +10,73 @@ IRunnable::~IRunnable() {}
 ITaskSystem::ITaskSystem(int num_threads) {}
 ITaskSystem::~ITaskSystem() {}
 
+void ITaskSystem::wait(TaskID task_id) {
+    sync();
+}
+
+bool ITaskSystem::poll(TaskID task_id) {
+    sync();
+    return true;
+}
+
+TaskID ITaskSystem::then(TaskID task_id, IRunnable* runnable, int num_total_tasks) {
+    return runAsyncWithDeps(runnable, num_total_tasks, {task_id});
+}
+
+void ITaskSystem::cancel(TaskID task_id) {}
+
+void ITaskSystem::wait(const std::vector<TaskID>& task_ids) {
+    for (TaskID task_id : task_ids) {
+        wait(task_id);
+    }
+}
+
+void ITaskSystem::run(IRunnable* runnable, int num_total_tasks, const LaunchHints& hints) {
+    run(runnable, num_total_tasks);
+}
+
+TaskID ITaskSystem::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                     const std::vector<TaskID>& deps, const LaunchHints& hints) {
+    return runAsyncWithDeps(runnable, num_total_tasks, deps);
+}
+
+TaskID ITaskSystem::runAsyncWithTaskDeps(IRunnable* runnable, int num_total_tasks,
+                                         TaskID dep, int block_size) {
+    return runAsyncWithDeps(runnable, num_total_tasks, {dep});
+}
+
+void ITaskSystem::replay(const TaskGraph& graph) {
+    std::vector<TaskID> task_ids(graph.size());
+    std::vector<TaskID> deps;
+    for (int i = 0; i < graph.size(); i++) {
+        const TaskGraph::Node& node = graph.node(i);
+        deps.assign(graph.dependencies(i), graph.dependencies(i) + node.num_dependencies);
+        for (TaskID& dep : deps) {
+            dep = task_ids[dep];
+        }
+        task_ids[i] = runAsyncWithDeps(node.runnable, node.num_total_tasks, deps);
+    }
+}
+
+std::vector<TaskID> ITaskSystem::submitBatch(const std::vector<BatchNode>& nodes) {
+    std::vector<TaskID> task_ids(nodes.size());
+    std::vector<TaskID> deps;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        deps = nodes[i].deps;
+        for (int dep : nodes[i].batch_deps) {
+            if (dep >= 0 && static_cast<size_t>(dep) < i) {
+                deps.push_back(task_ids[dep]);
+            }
+        }
+        task_ids[i] = runAsyncWithDeps(nodes[i].runnable, nodes[i].num_total_tasks, deps);
+    }
+    return task_ids;
+}
+
+void ITaskSystem::dumpStats() {}
+
+void ITaskSystem::startTrace(const char* path) {}
+
 /*
  * ================================================================
  * Serial task system implementation
@@ -88,22 +159,27 @@ const char* TaskSystemParallelThreadPoolSpinning::name() {
     return "Parallel + Thread Pool + Spin";
 }
 
-TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(int num_threads): ITaskSystem(num_threads) {
-    // NOTE: CS149 students are not expected to implement TaskSystemParallelThreadPoolSpinning in Part B.
+TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(int num_threads)
+    : ITaskSystem(num_threads) {
+    // NOTE: CS149 students are not expected to implement
+    // TaskSystemParallelThreadPoolSpinning in Part B.
 }
 
 TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {}
 
 void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, int num_total_tasks) {
-    // NOTE: CS149 students are not expected to implement TaskSystemParallelThreadPoolSpinning in Part B.
+    // NOTE: CS149 students are not expected to implement
+    // TaskSystemParallelThreadPoolSpinning in Part B.
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
 }
 
-TaskID TaskSystemParallelThreadPoolSpinning::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
-                                                              const std::vector<TaskID>& deps) {
-    // NOTE: CS149 students are not expected to implement TaskSystemParallelThreadPoolSpinning in Part B.
+TaskID TaskSystemParallelThreadPoolSpinning::runAsyncWithDeps(
+    IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps
+) {
+    // NOTE: CS149 students are not expected to implement
+    // TaskSystemParallelThreadPoolSpinning in Part B.
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
@@ -112,7 +188,8 @@ TaskID TaskSystemParallelThreadPoolSpinning::runAsyncWithDeps(IRunnable* runnabl
 }
 
 void TaskSystemParallelThreadPoolSpinning::sync() {
-    // NOTE: CS149 students are not expected to implement TaskSystemParallelThreadPoolSpinning in Part B.
+    // NOTE: CS149 students are not expected to implement
+    // TaskSystemParallelThreadPoolSpinning in Part B.
     return;
 }
 
@@ -122,44 +199,183 @@ void TaskSystemParallelThreadPoolSpinning::sync() {
  * ================================================================
  */
 
+namespace {
+
+// Identifies the pool worker running on this thread, if any, so that
+// work spawned from inside a task lands on the worker's own deque.
+thread_local TaskSystemParallelThreadPoolSleeping* current_pool = nullptr;
+thread_local int current_worker = -1;
+
+thread_local unsigned int steal_seed = 1;
+
+// The CPU this thread last found itself on, for current_node().
+constexpr unsigned int CPU_REFRESH_INTERVAL = 64;
+thread_local int cached_cpu = -1;
+thread_local unsigned int cpu_lookups = 0;
+
+// Launches made by the task running on this thread, so that a sync()
+// inside the task can wait for just those. task_scope is the index of the
+// current task's first launch, or -1 when no task is running.
+thread_local std::vector<TaskID> nested_launches;
+thread_local int task_scope = -1;
+
+inline void note_launch(const TaskID task_id) {
+    if (task_scope >= 0) {
+        nested_launches.push_back(task_id);
+    }
+}
+
+// When tracing, the end of the last task this thread ran: arrows to the
+// launches that task completed start there.
+thread_local double last_task_end = 0.0;
+
+// Chunks of cheap tasks are grown until a chunk takes roughly this long,
+// which amortizes the cost of claiming work over many tasks.
+constexpr double TARGET_CHUNK_SECONDS = 20e-6;
+
+// Upper bound on how long an idle thread spins before parking; a bit more
+// than a condition variable round trip costs.
+constexpr double MAX_SPIN_SECONDS = 100e-6;
+constexpr int MAX_SPIN_BACKOFF = 64;
+
+// How many groups a single launch may raise the priority of, going up
+// the graph from its dependencies.
+constexpr int MAX_PRIORITY_UPDATES = 32;
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+ * Tracks how long this thread typically waits between running out of work
+ * and finding more, as a moving average. IDLE_ADAPTIVE spins for about
+ * twice that when it fits in the budget and not at all otherwise.
+ */
+struct IdleTracker {
+    double idle_since = -1.0;
+    double average_gap = MAX_SPIN_SECONDS / 2;
+
+    void begin(const double now) {
+        if (idle_since < 0) {
+            idle_since = now;
+        }
+    }
+
+    void end(const double now) {
+        if (idle_since >= 0) {
+            average_gap += (now - idle_since - average_gap) / 8;
+            idle_since = -1.0;
+        }
+    }
+
+    double spin_budget(const IdlePolicy policy) const {
+        if (policy == IDLE_SPIN) {
+            return MAX_SPIN_SECONDS;
+        }
+        if (policy == IDLE_ADAPTIVE && average_gap < MAX_SPIN_SECONDS) {
+            return std::min(MAX_SPIN_SECONDS, 2 * average_gap);
+        }
+        return 0.0;
+    }
+};
+
+thread_local IdleTracker idle_tracker;
+
+// Spins until ready() holds or this idle period has used up its budget.
+template <typename Ready>
+bool spin_until_ready(const IdlePolicy policy, const Ready& ready) {
+    const double now = CycleTimer::currentSeconds();
+    idle_tracker.begin(now);
+    const double deadline = idle_tracker.idle_since + idle_tracker.spin_budget(policy);
+
+    int backoff = 1;
+    while (!ready()) {
+        if (CycleTimer::currentSeconds() >= deadline) {
+            return false;
+        }
+        for (int i = 0; i < backoff; ++i) {
+            cpu_relax();
+        }
+        // Once backed off fully, give the core away in case whoever we
+        // are waiting on shares it.
+        if (backoff < MAX_SPIN_BACKOFF) {
+            backoff *= 2;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    return true;
+}
+
+// xorshift32; only used to pick where a thief starts looking.
+inline unsigned int next_random() {
+    steal_seed ^= steal_seed << 13;
+    steal_seed ^= steal_seed >> 17;
+    steal_seed ^= steal_seed << 5;
+    return steal_seed;
+}
+
+}
+
+TaskSystemParallelThreadPoolSleeping::DependencyEdge
+TaskSystemParallelThreadPoolSleeping::closed_list;
+TaskSystemParallelThreadPoolSleeping::TaskGroup
+TaskSystemParallelThreadPoolSleeping::no_fine_successor;
+
 const char* TaskSystemParallelThreadPoolSleeping::name() {
     return "Parallel + Thread Pool + Sleep";
 }
 
-TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(const int num_threads)
+TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(
+    const int num_threads, const IdlePolicy idle_policy, const ThreadPlacement& placement,
+    const ElasticBounds& bounds, const SubmissionLimits& limits
+)
     : ITaskSystem(num_threads)
     , num_threads(num_threads)
+    , idle_policy(idle_policy == IDLE_ADAPTIVE &&
+                  static_cast<unsigned int>(num_threads) > std::thread::hardware_concurrency()
+                  ? IDLE_SLEEP : idle_policy)
+    , elastic(clamp_bounds(bounds, num_threads))
+    , limits(limits)
+    , worker_cpus(num_threads, -1)
+    , task_stats(num_threads)
 {
-    threads = new std::thread *[num_threads];
+    std::vector<CpuInfo> topology;
+    if (placement.policy != PLACEMENT_NONE) {
+        topology = read_cpu_topology();
+        worker_cpus = place_threads(placement, num_threads, topology);
+        num_nodes = num_cpu_nodes(topology);
+        cpu_nodes = cpu_node_table(topology);
+    }
+    worker_nodes.resize(num_threads);
+    node_queues.resize(num_nodes);
     for (int i = 0; i < num_threads; ++i) {
-        threads[i] = new std::thread([this] {
-            while (true) {
-                std::function<void()> task_to_run;
-                {
-                    std::unique_lock<std::mutex> lock(mtx);
-
-                    cv.wait(lock, [this] {
-                        return stop || !tasks.empty();
-                    });
-
-                    if (stop && tasks.empty()) {
-                        return;
-                    }
-
-                    if (tasks.empty()) {
-                        continue;
-                    }
-
-                    task_to_run = tasks.front();
-                    tasks.pop();
-                }
+        worker_nodes[i] = worker_cpus[i] >= 0 ? cpu_node(topology, worker_cpus[i]) : 0;
+        node_queues[worker_nodes[i]].push_back(i);
+    }
+    for (int node = 0; node < num_nodes; ++node) {
+        node_queues[node].push_back(num_threads + node);
+    }
 
-                task_to_run();
-            }
-        });
+    queues = new WorkerQueue[num_threads + num_nodes];
+    threads = new std::thread *[num_threads]();
+    worker_live.reset(new bool[num_threads]());
+    const int num_started = elastic.enabled() ? elastic.min_threads : num_threads;
+    for (int i = 0; i < num_started; ++i) {
+        start_worker(i);
     }
 }
 
+TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(
+    const int num_threads, const ThreadPlacement& placement, const ElasticBounds& bounds,
+    const SubmissionLimits& limits
+)
+    : TaskSystemParallelThreadPoolSleeping(num_threads, IDLE_ADAPTIVE, placement, bounds, limits) {}
+
 TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
     {
         std::unique_lock<std::mutex> lock(mtx);
@@ -168,101 +384,1420 @@ TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
     cv.notify_all();
 
     for (int i = 0; i < num_threads; ++i) {
-        if (threads[i]->joinable()) {
+        if (threads[i] != nullptr && threads[i]->joinable()) {
             threads[i]->join();
         }
         delete threads[i];
     }
     delete[] threads;
+    delete[] queues;
+    trace.reset();
+
+    for (int i = 0; i < num_slots.load() / GROUPS_PER_SLAB; ++i) {
+        delete[] slabs[i].load();
+    }
+    for (GraphReplay *replay : replays) {
+        delete replay;
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::worker_loop(const int worker_id) {
+    current_pool = this;
+    current_worker = worker_id;
+    steal_seed = static_cast<unsigned int>(worker_id) * 2654435761u + 1;
+    ThreadStats &stats = task_stats.thread(worker_id);
+
+    while (true) {
+        TaskRange range;
+        if (claim_local(worker_id, range) || steal(worker_id, range)) {
+            idle_tracker.end(CycleTimer::currentSeconds());
+            run_range(range);
+            continue;
+        }
+
+        if (stop.load() && num_queued.load() == 0) {
+            return;
+        }
+
+        const double spin_start = stats_clock();
+        const bool ready = spin_until_ready(idle_policy, [this] {
+            return stop.load() || num_queued.load() > 0;
+        });
+        stats.add_spin(stats_clock() - spin_start);
+        if (ready) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mtx);
+        num_sleeping.fetch_add(1);
+        const double park_start = stats_clock();
+        const auto has_work = [this] {
+            return stop.load() || num_queued.load() > 0;
+        };
+        bool woken = true;
+        if (elastic.enabled()) {
+            const std::chrono::duration<double> retire_after(elastic.retire_after);
+            woken = cv.wait_for(lock, retire_after, has_work);
+        } else {
+            cv.wait(lock, has_work);
+        }
+        stats.add_idle(stats_clock() - park_start);
+        num_sleeping.fetch_sub(1);
+        lock.unlock();
+        if (!woken && retire_worker(worker_id)) {
+            return;
+        }
+        stats.count_wakeup();
+    }
+}
+
+// Starts worker_id on a new thread and returns the thread of the worker
+// that retired from the slot, if any, for the caller to join once it no
+// longer holds elastic_mtx.
+std::thread* TaskSystemParallelThreadPoolSleeping::start_worker(const int worker_id) {
+    std::thread *retired = threads[worker_id];
+    worker_live[worker_id] = true;
+    num_live.fetch_add(1);
+
+    const int cpu = worker_cpus[worker_id];
+    threads[worker_id] = new std::thread([this, worker_id, cpu] {
+        pin_current_thread(cpu);
+        worker_loop(worker_id);
+    });
+    return retired;
+}
+
+/*
+ * Retires a worker that has been parked for retire_after, unless that
+ * would leave fewer than min_threads. The worker stopped counting towards
+ * num_sleeping before it looks at num_queued here, so wake_workers() for
+ * work queued after that look does not count on it, and the workers that
+ * remain find the work as usual.
+ */
+bool TaskSystemParallelThreadPoolSleeping::retire_worker(const int worker_id) {
+    std::lock_guard<std::mutex> lock(elastic_mtx);
+    if (num_live.load() <= elastic.min_threads || num_queued.load() > 0 || stop.load()) {
+        return false;
+    }
+    worker_live[worker_id] = false;
+    num_live.fetch_sub(1);
+    return true;
+}
+
+// Starts retired workers for up to num_tasks tasks that no parked worker
+// is left to take.
+void TaskSystemParallelThreadPoolSleeping::grow(int num_tasks) {
+    std::vector<std::thread*> retired;
+    {
+        std::lock_guard<std::mutex> lock(elastic_mtx);
+        for (int i = 0; i < num_threads && num_tasks > 0; ++i) {
+            if (!worker_live[i] && !stop.load()) {
+                if (std::thread *thread = start_worker(i)) {
+                    retired.push_back(thread);
+                }
+                num_tasks--;
+            }
+        }
+    }
+    // A retired thread has nothing left to do but exit.
+    for (std::thread *thread : retired) {
+        thread->join();
+        delete thread;
+    }
+}
+
+bool TaskSystemParallelThreadPoolSleeping::claim_from(
+    const int queue_id, const bool from_back, TaskRange& range
+) {
+    WorkerQueue &queue = queues[queue_id];
+    std::unique_lock<std::mutex> lock(queue.mtx, std::defer_lock);
+    lock_counted(lock, thread_stats());
+    if (queue.groups.empty()) {
+        return false;
+    }
+
+    // Thieves take the oldest of the groups with the highest priority.
+    std::deque<TaskGroup*>::iterator entry = queue.groups.end() - 1;
+    if (!from_back) {
+        entry = std::lower_bound(queue.groups.begin(), entry, (*entry)->queue_priority,
+                                 [](const TaskGroup* group, int priority) {
+                                     return group->queue_priority < priority;
+                                 });
+    }
+
+    TaskGroup *group = *entry;
+    if (group->schedule == SCHEDULE_STATIC_INTERLEAVED) {
+        queue.groups.erase(entry);
+        num_queued.fetch_sub(1);
+
+        range.group = group;
+        range.begin = queue_id;
+        range.end = group->num_total_tasks;
+        range.stride = std::min(group->num_total_tasks, num_threads);
+        return true;
+    }
+
+    std::atomic<int> *next_task = &group->next_task;
+    int last_task = group->num_total_tasks;
+    if (group->partitioned) {
+        next_task = &group->partitions[queue_id].next_task;
+        last_task = partition_begin(group->num_total_tasks, queue_id + 1);
+    }
+
+    // Nobody else claims from next_task while we hold the lock.
+    int chunk = group->chunk_size.load(std::memory_order_relaxed);
+    if (group->schedule == SCHEDULE_STATIC) {
+        chunk = last_task - next_task->load(std::memory_order_relaxed);
+    } else if (group->schedule == SCHEDULE_DYNAMIC) {
+        chunk = group->min_chunk_size;
+    } else if (group->schedule == SCHEDULE_GUIDED) {
+        const int remaining = last_task - next_task->load(std::memory_order_relaxed);
+        chunk = std::max(group->min_chunk_size, remaining / num_threads);
+    }
+    const int begin = next_task->fetch_add(chunk, std::memory_order_relaxed);
+    const int end = std::min(begin + chunk, last_task);
+
+    // Claims only happen under the lock of the queue holding the group,
+    // so whoever takes the last chunk is the one to unlink it. Raising the
+    // priority of the group from then on has no queue to look in.
+    if (end == last_task) {
+        queue.groups.erase(entry);
+        group->queue_id.store(-1);
+        num_queued.fetch_sub(1);
+    }
+
+    range.group = group;
+    range.begin = begin;
+    range.end = end;
+    range.stride = 1;
+    return true;
+}
+
+// Queues group behind every group of the same or a higher priority.
+// Called with the queue's lock held. Most groups go on either end, which
+// costs as little as the plain deque push did; only a group that belongs
+// in between is inserted there.
+void TaskSystemParallelThreadPoolSleeping::push_by_priority(WorkerQueue& queue, TaskGroup* group) {
+    if (queue.groups.empty() || queue.groups.back()->queue_priority <= group->queue_priority) {
+        queue.groups.push_back(group);
+        return;
+    }
+    if (group->queue_priority < queue.groups.front()->queue_priority) {
+        queue.groups.push_front(group);
+        return;
+    }
+    const std::deque<TaskGroup*>::iterator position =
+        std::upper_bound(queue.groups.begin(), queue.groups.end(), group->queue_priority,
+                         [](int priority, const TaskGroup* other) {
+                             return priority < other->queue_priority;
+                         });
+    queue.groups.insert(position, group);
+}
+
+// Moves a queued group to where its raised priority puts it, if it still
+// waits in a single queue.
+void TaskSystemParallelThreadPoolSleeping::requeue_by_priority(TaskGroup* group) {
+    const int queue_id = group->queue_id.load();
+    if (queue_id < 0) {
+        return;
+    }
+
+    WorkerQueue &queue = queues[queue_id];
+    std::unique_lock<std::mutex> lock(queue.mtx, std::defer_lock);
+    lock_counted(lock, thread_stats());
+    const int priority = group->priority.load(std::memory_order_relaxed);
+    if (group->queue_priority >= priority) {
+        return;
+    }
+    typedef std::deque<TaskGroup*>::iterator QueueIterator;
+    const std::pair<QueueIterator, QueueIterator> same_priority =
+        std::equal_range(queue.groups.begin(), queue.groups.end(), group,
+                         [](const TaskGroup* a, const TaskGroup* b) {
+                             return a->queue_priority < b->queue_priority;
+                         });
+    const QueueIterator entry = std::find(same_priority.first, same_priority.second, group);
+    if (entry == same_priority.second) {
+        return;
+    }
+    queue.groups.erase(entry);
+    group->queue_priority = priority;
+    push_by_priority(queue, group);
+}
+
+bool TaskSystemParallelThreadPoolSleeping::claim_local(const int worker_id, TaskRange& range) {
+    return claim_from(worker_id, true, range);
+}
+
+bool TaskSystemParallelThreadPoolSleeping::steal(const int thief_id, TaskRange& range) {
+    const int home = thief_id >= 0 ? worker_nodes[thief_id] : current_node();
+
+    for (int i = 0; i < num_nodes; ++i) {
+        const std::vector<int> &victims = node_queues[(home + i) % num_nodes];
+        const int num_victims = static_cast<int>(victims.size());
+        const int first_victim = static_cast<int>(next_random() % num_victims);
+        for (int j = 0; j < num_victims; ++j) {
+            const int victim = victims[(first_victim + j) % num_victims];
+            if (victim != thief_id && claim_from(victim, false, range)) {
+                thread_stats().count_steal();
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// The NUMA node the calling thread is running on, as far as it is known.
+// Threads outside the pool are not pinned, so this is only a hint, and the
+// CPU is looked up again only every CPU_REFRESH_INTERVAL calls.
+int TaskSystemParallelThreadPoolSleeping::current_node() const {
+    if (num_nodes == 1) {
+        return 0;
+    }
+    if (cpu_lookups++ % CPU_REFRESH_INTERVAL == 0) {
+        cached_cpu = current_cpu();
+    }
+    if (cached_cpu < 0 || cached_cpu >= static_cast<int>(cpu_nodes.size())) {
+        return 0;
+    }
+    const int node = cpu_nodes[cached_cpu];
+    return node < num_nodes ? node : 0;
+}
+
+void TaskSystemParallelThreadPoolSleeping::run_range(const TaskRange& range) {
+    TaskGroup *group = range.group;
+    int begin = range.begin;
+    int end = range.end;
+    int stride = range.stride;
+    ThreadStats &stats = thread_stats();
+
+    // Each pass runs the tasks of one group, then moves on to the blocks of
+    // its fine-grained successor that those tasks completed, if any.
+    while (begin < end) {
+        TaskGroup *successor = close_fine_successor(group);
+        const int count = (end - begin + stride - 1) / stride;
+        int num_run = 0;
+
+        // Tasks may launch and sync nested work; see sync().
+        const int outer_scope = task_scope;
+        task_scope = static_cast<int>(nested_launches.size());
+        TaskTrace *const tracer = trace.get();
+        const double start_time = CycleTimer::currentSeconds();
+        // Once the group is cancelled, or past its deadline, the rest of
+        // the range is skipped, whichever way the range was claimed.
+        for (int i = begin; i < end; i += stride) {
+            if (is_cancelled(group)) {
+                break;
+            }
+            ++num_run;
+            if (tracer == nullptr) {
+                group->runnable->runTask(i, group->num_total_tasks);
+            } else {
+                const double task_begin = TaskTrace::now();
+                if (i == 0) {
+                    trace_dependencies_end(group, task_begin);
+                }
+                group->runnable->runTask(i, group->num_total_tasks);
+                last_task_end = TaskTrace::now();
+                tracer->task(thread_slot(), group->id.load(), i, task_begin, last_task_end);
+            }
+            nested_launches.resize(task_scope);
+        }
+        const double elapsed = CycleTimer::currentSeconds() - start_time;
+        task_scope = outer_scope;
+        stats.count_tasks(num_run);
+        stats.add_busy(elapsed);
+
+        if (successor != nullptr && group->cancelled.load(std::memory_order_relaxed)) {
+            successor->cancelled.store(true, std::memory_order_relaxed);
+        }
+
+        // Size the next chunk from what this one cost. This has to happen
+        // before tasks_remaining drops, since the group may be finished after.
+        const double seconds_per_task = elapsed / count;
+        int next_chunk = group->max_chunk_size;
+        if (seconds_per_task * group->max_chunk_size > TARGET_CHUNK_SECONDS) {
+            next_chunk = std::max(1, static_cast<int>(TARGET_CHUNK_SECONDS / seconds_per_task));
+        }
+        // A claimed range drags the work of its successor blocks along, so
+        // hand those out one block at a time to keep the pool balanced.
+        if (successor != nullptr) {
+            next_chunk = std::min(next_chunk, successor->block_size);
+        }
+        group->chunk_size.store(next_chunk, std::memory_order_relaxed);
+
+        // Only the blocks at either end can be partly covered by the range,
+        // so the blocks it completes are contiguous. Interleaved groups
+        // never have a successor, so the range has a stride of 1 here.
+        int next_begin = 0;
+        int next_end = 0;
+        if (successor != nullptr) {
+            const int block_size = successor->block_size;
+            const int num_successor_tasks = successor->num_total_tasks;
+            for (int block = begin / block_size; block * block_size < end; ++block) {
+                const int covered =
+                    std::min(end, (block + 1) * block_size) - std::max(begin, block * block_size);
+                if (successor->block_pending[block].fetch_sub(covered) == covered) {
+                    if (next_begin == next_end) {
+                        next_begin = block * block_size;
+                    }
+                    next_end = std::min((block + 1) * block_size, num_successor_tasks);
+                }
+            }
+        }
+
+        TaskGroup *continuation = nullptr;
+        if (group->tasks_remaining.fetch_sub(count) == count) {
+            continuation = notify_dependents_of_completion(group);
+        }
+
+        group = successor;
+        begin = next_begin;
+        end = next_end;
+        stride = 1;
+
+        // Successor blocks are already in cache, so they go first and the
+        // continuation is queued like any other launch.
+        if (continuation != nullptr) {
+            TaskRange next;
+            if (begin < end) {
+                enqueue_tasks_for_group(continuation);
+            } else if (start_continuation(continuation, next)) {
+                group = next.group;
+                begin = next.begin;
+                end = next.end;
+            }
+        }
+    }
 }
 
 void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, const int num_total_tasks) {
-    runAsyncWithDeps(runnable, num_total_tasks, {});
+    run(runnable, num_total_tasks, LaunchHints());
+}
+
+void TaskSystemParallelThreadPoolSleeping::run(
+    IRunnable* runnable, const int num_total_tasks, const LaunchHints& hints
+) {
+    const OverloadPolicy policy = limits.policy == OVERLOAD_REJECT ? OVERLOAD_HELP : limits.policy;
+    launch(runnable, num_total_tasks, {}, hints, policy);
     sync();
 }
 
 TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(
     IRunnable* runnable, const int num_total_tasks, const std::vector<TaskID>& deps
 ) {
-    const TaskID new_id = next_task_id.fetch_add(1);
-    auto group = std::make_unique<TaskGroup>(new_id, runnable, num_total_tasks);
+    return runAsyncWithDeps(runnable, num_total_tasks, deps, LaunchHints());
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(
+    IRunnable* runnable, const int num_total_tasks, const std::vector<TaskID>& deps,
+    const LaunchHints& hints
+) {
+    return launch(runnable, num_total_tasks, deps, hints, limits.policy);
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::launch(
+    IRunnable* runnable, const int num_total_tasks, const std::vector<TaskID>& deps,
+    const LaunchHints& hints, const OverloadPolicy policy
+) {
+    if (!admit(1, num_total_tasks, policy)) {
+        return REJECTED_TASK;
+    }
+
+    TaskGroup *group = allocate_group(runnable, num_total_tasks);
+    group->schedule = hints.schedule;
+    group->min_chunk_size = std::max(1, hints.chunk_size);
+    group->deadline = hints.deadline;
+    group->partitioned = (hints.cache_affinity && num_threads > 1)
+                         || hints.schedule == SCHEDULE_STATIC;
+    return submit_group(group, deps);
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithTaskDeps(
+    IRunnable* runnable, const int num_total_tasks, const TaskID dep, const int block_size
+) {
+    if (num_total_tasks <= 0 || block_size < 1) {
+        return runAsyncWithDeps(runnable, num_total_tasks, {dep});
+    }
 
-    std::unique_lock<std::mutex> lock(graph_mtx);
+    // Admission and allocation may wait for launches to retire, so they
+    // come before dep is pinned: a pinned group cannot be recycled.
+    if (!admit(1, num_total_tasks, limits.policy)) {
+        return REJECTED_TASK;
+    }
+    TaskGroup *group = allocate_group(runnable, num_total_tasks);
 
-    int outstanding_deps = 0;
+    TaskGroup *dep_group = pin_group(dep);
+    if (dep_group == nullptr) {
+        return submit_group(group, {});
+    }
+    // Blocks are counted down by contiguous ranges of dep.
+    if (dep_group->num_total_tasks != num_total_tasks
+        || dep_group->schedule == SCHEDULE_STATIC_INTERLEAVED) {
+        unpin_group(dep_group);
+        return submit_group(group, {dep});
+    }
+
+    const int num_blocks = (num_total_tasks + block_size - 1) / block_size;
+    if (group->block_capacity < num_blocks) {
+        group->block_pending.reset(new std::atomic<int>[num_blocks]);
+        group->block_capacity = num_blocks;
+    }
+    for (int block = 0; block < num_blocks; ++block) {
+        const int block_tasks = std::min(block_size, num_total_tasks - block * block_size);
+        group->block_pending[block].store(block_tasks);
+    }
+    group->block_size = block_size;
+
+    // The group may finish and be recycled as soon as it is registered.
+    const TaskID new_id = group->id.load();
+    TaskGroup *expected = nullptr;
+    if (dep_group->fine_successor.compare_exchange_strong(expected, group)) {
+        unpin_group(dep_group);
+        note_launch(new_id);
+        return new_id;
+    }
+
+    // dep has already started running, or feeds another launch this way.
+    unpin_group(dep_group);
+    return submit_group(group, {dep});
+}
 
+TaskID TaskSystemParallelThreadPoolSleeping::then(
+    const TaskID task_id, IRunnable* runnable, const int num_total_tasks
+) {
+    if (!admit(1, num_total_tasks, limits.policy)) {
+        return REJECTED_TASK;
+    }
+
+    TaskGroup *group = allocate_group(runnable, num_total_tasks);
+    group->continuation = true;
+    return submit_group(group, {task_id});
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::submit_group(
+    TaskGroup* group, const std::vector<TaskID>& deps
+) {
+    // Hold back one count while edges are wired so that prerequisites
+    // finishing in the meantime cannot release the group early.
+    group->outstanding_dependencies.store(1);
+    group->edges.reserve(deps.size());
+    add_dependencies(group, deps);
+
+    // The group may finish and be recycled as soon as it is enqueued.
+    const TaskID new_id = group->id.load();
+    note_launch(new_id);
+    if (group->outstanding_dependencies.fetch_sub(1) == 1) {
+        enqueue_tasks_for_group(group);
+    }
+
+    return new_id;
+}
+
+// Makes group wait for each launch in deps that is not done yet. The
+// caller holds back a count of its own and has reserved room for the
+// edges, which must not move once registered.
+void TaskSystemParallelThreadPoolSleeping::add_dependencies(
+    TaskGroup* group, const std::vector<TaskID>& deps
+) {
     for (const TaskID &dep_id : deps) {
-        auto it = all_groups.find(dep_id);
-        if (it != all_groups.end()) {
-            TaskGroup *dep_group = it->second.get();
-            if (dep_group->tasks_remaining.load() > 0) {
-                dep_group->dependents.push_back(new_id);
-                outstanding_deps++;
+        TaskGroup *dep_group = pin_group(dep_id);
+        if (dep_group == nullptr) {
+            continue;
+        }
+
+        group->edges.push_back({group, nullptr, dep_id});
+        group->outstanding_dependencies.fetch_add(1);
+        if (add_dependent(dep_group, &group->edges.back())) {
+            raise_priority(dep_group, group->priority.load(std::memory_order_relaxed));
+        } else {
+            group->outstanding_dependencies.fetch_sub(1);
+            group->edges.pop_back();
+        }
+        unpin_group(dep_group);
+    }
+}
+
+// How long a launch of num_total_tasks is on the critical path, in waves
+// of num_threads tasks.
+int TaskSystemParallelThreadPoolSleeping::launch_weight(const int num_total_tasks) const {
+    return std::max(0, (num_total_tasks + num_threads - 1) / num_threads);
+}
+
+/*
+ * Raises the priority of group, which the caller has pinned, to cover a
+ * new successor of the given priority, and goes on up through the
+ * prerequisites of each group it raises that is still waiting. It stops
+ * after MAX_PRIORITY_UPDATES groups, so a launch at the bottom of a long
+ * chain only lifts the part of the chain nearest to it. A prerequisite
+ * that already outranks what it would be raised to is passed over before
+ * it is pinned, so a launch that changes no priority costs a few loads.
+ * Priorities only order the queues, so racing with other updates or with
+ * a group's release merely leaves one a little stale.
+ */
+void TaskSystemParallelThreadPoolSleeping::raise_priority(
+    TaskGroup* group, const int successor_priority
+) {
+    std::pair<TaskID, int> pending[MAX_PRIORITY_UPDATES];
+    int num_pending = 0;
+    int num_updates = 0;
+
+    TaskGroup *current = group;
+    int above = successor_priority;
+    while (current != nullptr) {
+        const int priority = above + launch_weight(current->num_total_tasks);
+        int old_priority = current->priority.load(std::memory_order_relaxed);
+        bool raised = false;
+        while (old_priority < priority && !raised) {
+            raised = current->priority.compare_exchange_weak(old_priority, priority,
+                                                             std::memory_order_relaxed);
+        }
+        if (raised && current->outstanding_dependencies.load() > 0) {
+            for (const DependencyEdge &edge : current->edges) {
+                if (num_pending == MAX_PRIORITY_UPDATES) {
+                    break;
+                }
+                pending[num_pending++] = {edge.prerequisite, priority};
             }
+        } else if (raised) {
+            requeue_by_priority(current);
+        }
+        if (current != group) {
+            unpin_group(current);
+        }
+
+        current = nullptr;
+        while (current == nullptr && num_pending > 0 && num_updates < MAX_PRIORITY_UPDATES) {
+            const std::pair<TaskID, int> next = pending[--num_pending];
+            const TaskGroup *peek = group_in_slot(next.first);
+            if (peek == nullptr || peek->id.load() != next.first ||
+                peek->priority.load(std::memory_order_relaxed) >=
+                    next.second + peek->weight.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            num_updates++;
+            current = pin_group(next.first);
+            above = next.second;
         }
     }
+}
 
-    group->outstanding_dependencies.store(outstanding_deps);
-    total_incomplete_groups.fetch_add(1);
+/*
+ * Takes the slots of the whole batch at once, when there is room for all
+ * of them, then wires every edge while each group still holds back a
+ * count of its own, so nothing in the batch is released before all of it
+ * is in place. The nodes that are ready then go out together through
+ * enqueue_groups(). Priorities are exact bottom levels within the batch.
+ */
+std::vector<TaskID> TaskSystemParallelThreadPoolSleeping::submitBatch(
+    const std::vector<BatchNode>& nodes
+) {
+    const int num_nodes = static_cast<int>(nodes.size());
 
-    TaskGroup *group_ptr = group.get();
-    all_groups[new_id] = std::move(group);
+    // As in replay(), every group is allocated before any is released.
+    if (num_nodes > MAX_GROUPS / 2) {
+        return ITaskSystem::submitBatch(nodes);
+    }
 
-    if (outstanding_deps == 0) {
-        enqueue_tasks_for_group(group_ptr);
+    // The batch is admitted, or rejected, as a whole.
+    long long num_tasks = 0;
+    for (const BatchNode &node : nodes) {
+        num_tasks += std::max(0, node.num_total_tasks);
+    }
+    if (!admit(num_nodes, num_tasks, limits.policy)) {
+        return std::vector<TaskID>(num_nodes, REJECTED_TASK);
     }
 
-    return new_id;
+    std::vector<TaskGroup*> groups(num_nodes);
+    take_free_groups(groups.data(), num_nodes);
+
+    std::vector<TaskID> task_ids(num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        reset_group(groups[i], nodes[i].runnable, nodes[i].num_total_tasks);
+        task_ids[i] = groups[i]->id.load();
+        note_launch(task_ids[i]);
+    }
+
+    // Bottom levels, from the last node up: every dependency of a node
+    // comes before it in the batch.
+    for (int i = num_nodes - 1; i >= 0; --i) {
+        const int priority = groups[i]->priority.load(std::memory_order_relaxed);
+        for (const int dep : nodes[i].batch_deps) {
+            if (dep < 0 || dep >= i) {
+                continue;
+            }
+            const int dep_priority = launch_weight(nodes[dep].num_total_tasks) + priority;
+            if (groups[dep]->priority.load(std::memory_order_relaxed) < dep_priority) {
+                groups[dep]->priority.store(dep_priority, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_nodes; ++i) {
+        const BatchNode &node = nodes[i];
+        TaskGroup *group = groups[i];
+        group->outstanding_dependencies.store(1);
+        group->edges.reserve(node.deps.size() + node.batch_deps.size());
+        add_dependencies(group, node.deps);
+        for (const int dep : node.batch_deps) {
+            if (dep < 0 || dep >= i) {
+                continue;
+            }
+            // Held back, so the registration cannot lose to completion.
+            group->edges.push_back({group, nullptr, task_ids[dep]});
+            group->outstanding_dependencies.fetch_add(1);
+            add_dependent(groups[dep], &group->edges.back());
+        }
+    }
+
+    // Groups still waiting may be released (and finish) from here on.
+    std::vector<TaskGroup*> ready;
+    for (TaskGroup *group : groups) {
+        if (group->outstanding_dependencies.fetch_sub(1) == 1) {
+            ready.push_back(group);
+        }
+    }
+    enqueue_groups(ready);
+    return task_ids;
+}
+
+void TaskSystemParallelThreadPoolSleeping::replay(const TaskGraph& graph) {
+    const int num_nodes = graph.size();
+    if (num_nodes == 0) {
+        return;
+    }
+
+    // A replay has no TaskIDs to hand back, so it is never rejected.
+    const OverloadPolicy policy = limits.policy == OVERLOAD_REJECT ? OVERLOAD_HELP : limits.policy;
+
+    // Every group of a replay is allocated before any is released, so a
+    // graph that could use up all slots on its own goes the slow way.
+    if (num_nodes > MAX_GROUPS / 2) {
+        std::vector<TaskID> task_ids(num_nodes);
+        std::vector<TaskID> deps;
+        for (int i = 0; i < num_nodes; ++i) {
+            const TaskGraph::Node &node = graph.node(i);
+            deps.assign(graph.dependencies(i), graph.dependencies(i) + node.num_dependencies);
+            for (TaskID &dep : deps) {
+                dep = task_ids[dep];
+            }
+            task_ids[i] = launch(node.runnable, node.num_total_tasks, deps, LaunchHints(), policy);
+        }
+        return;
+    }
+
+    long long num_tasks = 0;
+    for (int i = 0; i < num_nodes; ++i) {
+        num_tasks += std::max(0, graph.node(i).num_total_tasks);
+    }
+    admit(num_nodes, num_tasks, policy);
+
+    GraphReplay *replay = allocate_replay();
+    replay->graph = &graph;
+    replay->groups.resize(num_nodes);
+    replay->ids.resize(num_nodes);
+    replay->nodes_remaining.store(num_nodes);
+
+    // As in submitBatch(), the slots are taken together so that a replay
+    // never waits on another while holding part of what it needs.
+    take_free_groups(replay->groups.data(), num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        const TaskGraph::Node &node = graph.node(i);
+        TaskGroup *group = replay->groups[i];
+        reset_group(group, node.runnable, node.num_total_tasks);
+        group->replay = replay;
+        group->graph_node = i;
+        group->outstanding_dependencies.store(node.num_dependencies);
+        // The graph's bottom level counts tasks; priorities count waves.
+        const long long waves = (node.bottom_level + num_threads - 1) / num_threads;
+        group->priority.store(static_cast<int>(std::min<long long>(waves, INT_MAX / 2)),
+                              std::memory_order_relaxed);
+        replay->ids[i] = group->id.load();
+        note_launch(replay->ids[i]);
+    }
+
+    // The replay cannot finish before its last root is enqueued.
+    for (const int root : graph.roots()) {
+        enqueue_tasks_for_group(replay->groups[root]);
+    }
+}
+
+/*
+ * Counts num_groups more launches of num_tasks tasks in all as in flight,
+ * once they fit in the limits (see backpressure.h), or returns false if
+ * policy rejects them.
+ */
+bool TaskSystemParallelThreadPoolSleeping::admit(const int num_groups, const long long num_tasks,
+                                                 OverloadPolicy policy) {
+    if (!limits.enabled()) {
+        total_incomplete_groups.fetch_add(num_groups);
+        return true;
+    }
+
+    // Inside a task, what we wait for may be waiting for the task itself.
+    const bool nested = task_scope >= 0;
+    if (nested && policy == OVERLOAD_BLOCK) {
+        policy = OVERLOAD_HELP;
+    }
+
+    std::unique_lock<std::mutex> lock(admission_mtx);
+    while (!has_room(num_groups, num_tasks)) {
+        if (policy == OVERLOAD_REJECT) {
+            return false;
+        }
+        if (policy == OVERLOAD_BLOCK) {
+            num_admission_waiters.fetch_add(1);
+            admission_cv.wait(lock, [this, num_groups, num_tasks] {
+                return has_room(num_groups, num_tasks);
+            });
+            num_admission_waiters.fetch_sub(1);
+            break;
+        }
+
+        lock.unlock();
+        help_until([this, nested, num_groups, num_tasks] {
+            return has_room(num_groups, num_tasks) || (nested && num_queued.load() == 0);
+        });
+        lock.lock();
+        if (nested && num_queued.load() == 0) {
+            break;
+        }
+    }
+
+    total_incomplete_groups.fetch_add(num_groups);
+    if (limits.max_tasks > 0) {
+        tasks_in_flight.fetch_add(num_tasks);
+    }
+    return true;
+}
+
+// Anything fits while nothing is in flight.
+bool TaskSystemParallelThreadPoolSleeping::has_room(
+    const int num_groups, const long long num_tasks
+) const {
+    const int groups = total_incomplete_groups.load();
+    if (groups == 0) {
+        return true;
+    }
+    return (limits.max_groups <= 0 || groups + num_groups <= limits.max_groups) &&
+           (limits.max_tasks <= 0 || tasks_in_flight.load() + num_tasks <= limits.max_tasks);
+}
+
+TaskSystemParallelThreadPoolSleeping::TaskGroup*
+TaskSystemParallelThreadPoolSleeping::allocate_group(
+    IRunnable* runnable, const int num_total_tasks
+) {
+    std::unique_lock<std::mutex> lock(free_mtx);
+    TaskGroup *group = take_free_group(lock);
+    lock.unlock();
+
+    reset_group(group, runnable, num_total_tasks);
+    return group;
+}
+
+// Takes a group off the free list, which lock holds free_mtx for.
+TaskSystemParallelThreadPoolSleeping::TaskGroup*
+TaskSystemParallelThreadPoolSleeping::take_free_group(std::unique_lock<std::mutex>& lock) {
+    // Reuse the group that retired longest ago, so that a slot's generation
+    // (and hence its TaskIDs) takes as long as possible to wrap around. A
+    // new slab is only carved out when nothing has retired.
+    while (free_head == nullptr) {
+        const int first_slot = num_slots.load();
+        if (first_slot < MAX_GROUPS) {
+            TaskGroup *slab = new TaskGroup[GROUPS_PER_SLAB];
+            for (int i = 0; i < GROUPS_PER_SLAB; ++i) {
+                slab[i].slot = first_slot + i;
+                slab[i].next_free = i + 1 < GROUPS_PER_SLAB ? &slab[i + 1] : nullptr;
+            }
+            slabs[first_slot / GROUPS_PER_SLAB].store(slab);
+            num_slots.store(first_slot + GROUPS_PER_SLAB);
+
+            free_head = &slab[0];
+            free_tail = &slab[GROUPS_PER_SLAB - 1];
+            num_free += GROUPS_PER_SLAB;
+            break;
+        }
+
+        // Every slot holds an unfinished group.
+        wait_for_retired_group(lock);
+    }
+
+    TaskGroup *group = free_head;
+    free_head = group->next_free;
+    if (free_head == nullptr) {
+        free_tail = nullptr;
+    }
+    num_free--;
+    return group;
+}
+
+/*
+ * Takes count groups at once. It waits until there is room for all of
+ * them before taking any, since a thread that waited while holding some
+ * could be waiting on another doing the same.
+ */
+void TaskSystemParallelThreadPoolSleeping::take_free_groups(TaskGroup** groups, const int count) {
+    std::unique_lock<std::mutex> lock(free_mtx);
+    while (num_free + (MAX_GROUPS - num_slots.load()) < count) {
+        wait_for_retired_group(lock);
+    }
+    for (int i = 0; i < count; ++i) {
+        groups[i] = take_free_group(lock);
+    }
+}
+
+/*
+ * Runs queued work until another group retires, with free_mtx let go
+ * meanwhile. The caller may be a worker launching from inside a task, so
+ * it must not simply block: with every worker doing the same, nobody
+ * would be left to finish a group.
+ */
+void TaskSystemParallelThreadPoolSleeping::wait_for_retired_group(
+    std::unique_lock<std::mutex>& lock
+) {
+    const long long seen = num_retired.load();
+    num_allocation_waiters++;
+    lock.unlock();
+    help_until([this, seen] {
+        return num_retired.load() != seen;
+    });
+    lock.lock();
+    num_allocation_waiters--;
+}
+
+void TaskSystemParallelThreadPoolSleeping::reset_group(TaskGroup* group, IRunnable* runnable,
+                                                       const int num_total_tasks) {
+    // Nobody can pin the group while refs is zero, so it is safe to reset
+    // it here and publish it with the final store.
+    group->generation = group->generation == (INT_MAX >> SLOT_BITS) ? 1 : group->generation + 1;
+    group->id.store((group->generation << SLOT_BITS) | group->slot);
+    group->next_free = nullptr;
+
+    group->runnable = runnable;
+    group->num_total_tasks = num_total_tasks;
+    group->tasks_remaining.store(num_total_tasks);
+    group->dependents_head.store(nullptr);
+    group->edges.clear();
+    group->outstanding_dependencies.store(0);
+    group->replay = nullptr;
+    group->graph_node = 0;
+    group->fine_successor.store(nullptr);
+    group->block_size = 0;
+    group->continuation = false;
+    group->cancelled.store(false);
+    group->deadline = 0;
+    group->next_task.store(0);
+    group->chunk_size.store(1);
+    group->max_chunk_size = 1;
+    group->schedule = SCHEDULE_DEFAULT;
+    group->min_chunk_size = 1;
+    group->partitioned = false;
+    group->weight.store(launch_weight(num_total_tasks), std::memory_order_relaxed);
+    group->priority.store(launch_weight(num_total_tasks), std::memory_order_relaxed);
+    group->queue_id.store(-1);
+
+    if (trace) {
+        trace->launch_begin(thread_slot(), group->id.load(), num_total_tasks, TaskTrace::now());
+    }
+
+    group->refs.store(1);
+}
+
+// The group in the slot id names, whatever its generation, or nullptr.
+// Slabs are never freed, so it stays readable, but only the atomics of a
+// group that is not pinned may be looked at.
+TaskSystemParallelThreadPoolSleeping::TaskGroup*
+TaskSystemParallelThreadPoolSleeping::group_in_slot(const TaskID id) {
+    const int slot = id & (MAX_GROUPS - 1);
+    if (id <= 0 || slot >= num_slots.load()) {
+        return nullptr;
+    }
+    return &slabs[slot / GROUPS_PER_SLAB].load()[slot % GROUPS_PER_SLAB];
+}
+
+TaskSystemParallelThreadPoolSleeping::TaskGroup*
+TaskSystemParallelThreadPoolSleeping::pin_group(const TaskID id) {
+    TaskGroup *group = group_in_slot(id);
+    if (group == nullptr) {
+        return nullptr;
+    }
+
+    int refs = group->refs.load();
+    do {
+        if (refs == 0) {
+            return nullptr;
+        }
+    } while (!group->refs.compare_exchange_weak(refs, refs + 1));
+
+    // The pin may have landed on a later incarnation of the slot.
+    if (group->id.load() != id) {
+        unpin_group(group);
+        return nullptr;
+    }
+    return group;
+}
+
+void TaskSystemParallelThreadPoolSleeping::unpin_group(TaskGroup* group) {
+    if (group->refs.fetch_sub(1) == 1) {
+        recycle_group(group);
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::recycle_group(TaskGroup* group) {
+    std::unique_lock<std::mutex> lock(free_mtx);
+    if (free_tail == nullptr) {
+        free_head = group;
+    } else {
+        free_tail->next_free = group;
+    }
+    free_tail = group;
+    num_free++;
+    num_retired.fetch_add(1);
+
+    const bool waiters = num_allocation_waiters > 0;
+    lock.unlock();
+    if (waiters) {
+        std::unique_lock<std::mutex> sync_lock(mtx);
+        sync_cv.notify_all();
+    }
+}
+
+TaskSystemParallelThreadPoolSleeping::GraphReplay*
+TaskSystemParallelThreadPoolSleeping::allocate_replay() {
+    std::unique_lock<std::mutex> lock(free_mtx);
+    if (free_replays.empty()) {
+        replays.push_back(new GraphReplay);
+        return replays.back();
+    }
+
+    GraphReplay *replay = free_replays.back();
+    free_replays.pop_back();
+    return replay;
+}
+
+void TaskSystemParallelThreadPoolSleeping::recycle_replay(GraphReplay* replay) {
+    std::unique_lock<std::mutex> lock(free_mtx);
+    free_replays.push_back(replay);
+}
+
+TaskSystemParallelThreadPoolSleeping::TaskGroup*
+TaskSystemParallelThreadPoolSleeping::close_fine_successor(TaskGroup* group) {
+    TaskGroup *successor = group->fine_successor.load();
+    if (successor == nullptr) {
+        // On failure this picks up the successor that just registered.
+        group->fine_successor.compare_exchange_strong(successor, &no_fine_successor);
+    }
+    return successor == &no_fine_successor ? nullptr : successor;
+}
+
+bool TaskSystemParallelThreadPoolSleeping::is_cancelled(TaskGroup* group) {
+    if (group->cancelled.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    if (group->deadline > 0 && CycleTimer::currentSeconds() > group->deadline) {
+        group->cancelled.store(true, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+bool TaskSystemParallelThreadPoolSleeping::add_dependent(TaskGroup* group, DependencyEdge* edge) {
+    DependencyEdge *head = group->dependents_head.load();
+    do {
+        if (head == &closed_list) {
+            return false;
+        }
+        edge->next = head;
+    } while (!group->dependents_head.compare_exchange_weak(head, edge));
+    return true;
+}
+
+int TaskSystemParallelThreadPoolSleeping::partition_begin(
+    const int num_total_tasks, const int worker_id
+) const {
+    return static_cast<int>(static_cast<long long>(num_total_tasks) * worker_id / num_threads);
 }
 
 void TaskSystemParallelThreadPoolSleeping::enqueue_tasks_for_group(TaskGroup* group) {
-    int num_tasks_added = group->num_total_tasks;
+    if (group->num_total_tasks <= 0) {
+        TaskGroup *continuation = notify_dependents_of_completion(group);
+        if (continuation != nullptr) {
+            enqueue_tasks_for_group(continuation);
+        }
+        return;
+    }
+
+    // The group may be finished as soon as its last task is queued.
+    const int num_total_tasks = group->num_total_tasks;
+
+    // Leave each worker at least a few chunks so the tail still balances.
+    group->max_chunk_size = std::max(1, num_total_tasks / (4 * num_threads));
+    group->queue_priority = group->priority.load(std::memory_order_relaxed);
+
+    const bool interleaved = group->schedule == SCHEDULE_STATIC_INTERLEAVED;
+    if (group->partitioned || interleaved) {
+        if (group->partitioned) {
+            if (!group->partitions) {
+                group->partitions.reset(new Partition[num_threads]);
+            }
+            for (int i = 0; i < num_threads; ++i) {
+                group->partitions[i].next_task.store(partition_begin(num_total_tasks, i));
+            }
+        }
+        // With fewer tasks than workers, some workers get nothing.
+        for (int i = 0; i < num_threads; ++i) {
+            const int begin = partition_begin(num_total_tasks, i);
+            const bool has_tasks = interleaved ? i < num_total_tasks
+                                               : begin < partition_begin(num_total_tasks, i + 1);
+            if (has_tasks) {
+                std::unique_lock<std::mutex> lock(queues[i].mtx, std::defer_lock);
+                lock_counted(lock, thread_stats());
+                push_by_priority(queues[i], group);
+                task_stats.thread(i).note_queue_depth(queues[i].groups.size());
+            }
+        }
+        num_queued.fetch_add(std::min(num_total_tasks, num_threads));
+
+        wake_workers(num_total_tasks);
+        return;
+    }
+
+    // Workers keep follow-up work for themselves; everyone else goes
+    // through the shared queue of their node.
+    const int queue_id = current_pool == this ? current_worker : num_threads + current_node();
 
     {
-        std::unique_lock<std::mutex> lock(mtx);
-        for (int i = 0; i < num_tasks_added; ++i) {
-            auto work_item = [this, group, i] {
-                group->runnable->runTask(i, group->num_total_tasks);
-                if (group->tasks_remaining.fetch_sub(1) == 1) {
-                    notify_dependents_of_completion(group);
-                }
-            };
-            tasks.push(std::move(work_item));
+        std::unique_lock<std::mutex> lock(queues[queue_id].mtx, std::defer_lock);
+        lock_counted(lock, thread_stats());
+        push_by_priority(queues[queue_id], group);
+        group->queue_id.store(queue_id);
+        ThreadStats &queue_stats = task_stats.thread(std::min(queue_id, num_threads));
+        queue_stats.note_queue_depth(queues[queue_id].groups.size());
+    }
+    num_queued.fetch_add(1);
+
+    wake_workers(num_total_tasks);
+}
+
+// Queues groups that were released together, all on the calling thread's
+// queue under one lock, and wakes workers once for all of them.
+void TaskSystemParallelThreadPoolSleeping::enqueue_groups(const std::vector<TaskGroup*>& groups) {
+    std::vector<TaskGroup*> queued;
+    std::vector<TaskGroup*> empty;
+    int num_tasks = 0;
+    for (TaskGroup *group : groups) {
+        if (group->num_total_tasks <= 0) {
+            empty.push_back(group);
+            continue;
         }
+        group->max_chunk_size = std::max(1, group->num_total_tasks / (4 * num_threads));
+        group->queue_priority = group->priority.load(std::memory_order_relaxed);
+        num_tasks += group->num_total_tasks;
+        queued.push_back(group);
     }
 
+    if (!queued.empty()) {
+        const int queue_id = current_pool == this ? current_worker : num_threads + current_node();
+        {
+            std::unique_lock<std::mutex> lock(queues[queue_id].mtx, std::defer_lock);
+            lock_counted(lock, thread_stats());
+            for (TaskGroup *group : queued) {
+                push_by_priority(queues[queue_id], group);
+                group->queue_id.store(queue_id);
+            }
+            ThreadStats &queue_stats = task_stats.thread(std::min(queue_id, num_threads));
+            queue_stats.note_queue_depth(queues[queue_id].groups.size());
+        }
+        num_queued.fetch_add(static_cast<int>(queued.size()));
+        wake_workers(num_tasks);
+    }
 
-    if (num_tasks_added == 1) {
+    // These finish on the spot and release their dependents as usual.
+    for (TaskGroup *group : empty) {
+        enqueue_tasks_for_group(group);
+    }
+}
+
+// Claims the first chunk of a continuation that has just been released
+// for the calling thread, and queues the rest for everyone else. Returns
+// false if there is nothing to run.
+bool TaskSystemParallelThreadPoolSleeping::start_continuation(TaskGroup* group, TaskRange& range) {
+    const int num_total_tasks = group->num_total_tasks;
+    if (num_total_tasks <= 0) {
+        enqueue_tasks_for_group(group);
+        return false;
+    }
+
+    // Holding back the first chunk keeps the group alive once the rest
+    // is queued.
+    const int first_chunk =
+        std::min(num_total_tasks, std::max(1, num_total_tasks / (4 * num_threads)));
+    if (first_chunk < num_total_tasks) {
+        group->next_task.store(first_chunk);
+        enqueue_tasks_for_group(group);
+    }
+
+    range.group = group;
+    range.begin = 0;
+    range.end = first_chunk;
+    range.stride = 1;
+    return true;
+}
+
+void TaskSystemParallelThreadPoolSleeping::wake_workers(const int num_tasks) {
+    if (elastic.enabled() && num_live.load() < num_threads) {
+        const int num_unclaimed = num_tasks - num_sleeping.load();
+        if (num_unclaimed > 0) {
+            grow(num_unclaimed);
+        }
+    }
+    if (num_sleeping.load() == 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mtx);
+    if (num_tasks == 1) {
         cv.notify_one();
     }
     else {
         cv.notify_all();
     }
+    if (num_waiting.load() > 0) {
+        sync_cv.notify_all();
+    }
 }
 
-void TaskSystemParallelThreadPoolSleeping::notify_dependents_of_completion(TaskGroup* group) {
-    {
-        std::unique_lock<std::mutex> lock(graph_mtx);
-        for (const TaskID &dep: group->dependents) {
-            auto it = all_groups.find(dep);
-            if (it != all_groups.end()) {
-                TaskGroup *dep_group = it->second.get();
-                if (dep_group->outstanding_dependencies.fetch_sub(1) == 1) {
-                    enqueue_tasks_for_group(dep_group);
-                }
+// Returns one continuation released by the group, which the caller is
+// left to start; everything else it releases is queued.
+TaskSystemParallelThreadPoolSleeping::TaskGroup*
+TaskSystemParallelThreadPoolSleeping::notify_dependents_of_completion(TaskGroup* group) {
+    // Dependents must be traced before they are released, since they may
+    // finish and be recycled right after.
+    TaskTrace *const tracer = trace.get();
+    TaskGroup *continuation = nullptr;
+    const bool cancelled = group->cancelled.load();
+    const TaskID group_id = group->id.load();
+    const long long num_tasks = std::max(0, group->num_total_tasks);
+    const double task_end = group->num_total_tasks > 0 ? last_task_end : TaskTrace::now();
+
+    DependencyEdge *edge = group->dependents_head.exchange(&closed_list);
+    while (edge != nullptr) {
+        // The edge belongs to its dependent and may be reused as soon as
+        // that dependent is released, so step past it first.
+        DependencyEdge *next = edge->next;
+        TaskGroup *dependent = edge->dependent;
+        if (tracer != nullptr) {
+            tracer->dependency_begin(thread_slot(), group_id, dependent->id.load(), task_end);
+        }
+        if (cancelled) {
+            dependent->cancelled.store(true);
+        }
+        if (dependent->outstanding_dependencies.fetch_sub(1) == 1) {
+            if (dependent->continuation && continuation == nullptr) {
+                continuation = dependent;
+            } else {
+                enqueue_tasks_for_group(dependent);
+            }
+        }
+        edge = next;
+    }
+
+    GraphReplay *replay = group->replay;
+    if (replay != nullptr) {
+        const int node = group->graph_node;
+        const int *successors = replay->graph->successors(node);
+        for (int i = 0; i < replay->graph->node(node).num_successors; ++i) {
+            TaskGroup *dependent = replay->groups[successors[i]];
+            if (tracer != nullptr) {
+                tracer->dependency_begin(thread_slot(), group_id, replay->ids[successors[i]],
+                                         task_end);
+            }
+            if (cancelled) {
+                dependent->cancelled.store(true);
+            }
+            if (dependent->outstanding_dependencies.fetch_sub(1) == 1) {
+                enqueue_tasks_for_group(dependent);
             }
         }
     }
 
-    if (total_incomplete_groups.fetch_sub(1) == 1) {
-        std::unique_lock<std::mutex> lock(sync_mtx);
+    if (tracer != nullptr) {
+        tracer->launch_end(thread_slot(), group_id, TaskTrace::now());
+    }
+
+    unpin_group(group);
+
+    if (replay != nullptr && replay->nodes_remaining.fetch_sub(1) == 1) {
+        recycle_replay(replay);
+    }
+
+    if (limits.max_tasks > 0) {
+        tasks_in_flight.fetch_sub(num_tasks);
+    }
+    total_incomplete_groups.fetch_sub(1);
+
+    if (num_admission_waiters.load() > 0) {
+        std::unique_lock<std::mutex> lock(admission_mtx);
+        admission_cv.notify_all();
+    }
+    if (num_waiting.load() > 0) {
+        std::unique_lock<std::mutex> lock(mtx);
         sync_cv.notify_all();
     }
+
+    return continuation;
+}
+
+bool TaskSystemParallelThreadPoolSleeping::find_work(TaskRange& range) {
+    if (current_pool == this) {
+        return claim_local(current_worker, range) || steal(current_worker, range);
+    }
+
+    // Outside threads own no queue, so they may take from all of them.
+    return steal(-1, range);
+}
+
+void TaskSystemParallelThreadPoolSleeping::help_until(const std::function<bool()>& done) {
+    // Rather than idle, the caller pitches in like an extra worker and
+    // only parks when there is nothing left to claim.
+    ThreadStats &stats = thread_stats();
+    while (!done()) {
+        TaskRange range;
+        if (find_work(range)) {
+            idle_tracker.end(CycleTimer::currentSeconds());
+            run_range(range);
+            continue;
+        }
+
+        const double spin_start = stats_clock();
+        const bool ready = spin_until_ready(idle_policy, [this, &done] {
+            return done() || num_queued.load() > 0;
+        });
+        stats.add_spin(stats_clock() - spin_start);
+        if (ready) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mtx);
+        num_waiting.fetch_add(1);
+        num_sleeping.fetch_add(1);
+        const double park_start = stats_clock();
+        sync_cv.wait(lock, [this, &done] {
+            return done() || num_queued.load() > 0;
+        });
+        stats.add_idle(stats_clock() - park_start);
+        stats.count_wakeup();
+        num_sleeping.fetch_sub(1);
+        num_waiting.fetch_sub(1);
+    }
+    idle_tracker.end(CycleTimer::currentSeconds());
 }
 
 void TaskSystemParallelThreadPoolSleeping::sync() {
-    std::unique_lock<std::mutex> lock(sync_mtx);
-    sync_cv.wait(lock, [this]() {
+    // The launch of a task calling sync() cannot finish before the call
+    // returns, so there it only waits for what the task itself launched.
+    // Waiting still runs other work, so nested launches never leave the
+    // pool's threads all blocked.
+    if (task_scope >= 0) {
+        for (size_t i = task_scope; i < nested_launches.size(); ++i) {
+            wait(nested_launches[i]);
+        }
+        nested_launches.resize(task_scope);
+        return;
+    }
+
+    help_until([this] {
         return total_incomplete_groups.load() == 0;
     });
+
+    if (trace) {
+        trace->flush();
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::wait(const TaskID task_id) {
+    // Keep the group from being recycled while we watch it.
+    TaskGroup *group = pin_group(task_id);
+    if (group == nullptr) {
+        return;
+    }
+
+    help_until([group] {
+        return group->dependents_head.load() == &closed_list;
+    });
+    unpin_group(group);
+}
+
+bool TaskSystemParallelThreadPoolSleeping::poll(const TaskID task_id) {
+    TaskGroup *group = pin_group(task_id);
+    if (group == nullptr) {
+        return true;
+    }
+
+    const bool done = group->dependents_head.load() == &closed_list;
+    unpin_group(group);
+    return done;
+}
+
+/*
+ * Dependents still waiting on a cancelled group inherit the flag when it
+ * completes, before they are released. A fine-grained successor is
+ * released block by block while the group runs, so it is marked here
+ * straight away, and so is its own successor, on down the pipeline.
+ */
+void TaskSystemParallelThreadPoolSleeping::cancel(const TaskID task_id) {
+    TaskGroup *group = pin_group(task_id);
+    while (group != nullptr) {
+        group->cancelled.store(true);
+
+        // A successor cannot finish before every task of the group has,
+        // so while the group has tasks left the ID read is still its own.
+        TaskGroup *next = nullptr;
+        TaskGroup *successor = group->fine_successor.load();
+        if (successor != nullptr && successor != &no_fine_successor) {
+            const TaskID successor_id = successor->id.load();
+            if (group->tasks_remaining.load() > 0) {
+                next = pin_group(successor_id);
+            }
+        }
+        unpin_group(group);
+        group = next;
+    }
+}
+
+int TaskSystemParallelThreadPoolSleeping::thread_slot() const {
+    return current_pool == this ? current_worker : num_threads;
+}
+
+ThreadStats& TaskSystemParallelThreadPoolSleeping::thread_stats() {
+    return task_stats.thread(thread_slot());
+}
+
+void TaskSystemParallelThreadPoolSleeping::dumpStats() {
+    task_stats.dump(name());
+}
+
+void TaskSystemParallelThreadPoolSleeping::startTrace(const char* path) {
+    trace.reset(new TaskTrace(num_threads, path, name()));
+    if (!trace->is_open()) {
+        trace.reset();
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::trace_dependencies_end(
+    TaskGroup* group, const double task_begin
+) {
+    const TaskID group_id = group->id.load();
+    for (const DependencyEdge &edge : group->edges) {
+        trace->dependency_end(thread_slot(), edge.prerequisite, group_id, task_begin);
+    }
+
+    GraphReplay *replay = group->replay;
+    if (replay != nullptr) {
+        const int *dependencies = replay->graph->dependencies(group->graph_node);
+        for (int i = 0; i < replay->graph->node(group->graph_node).num_dependencies; ++i) {
+            trace->dependency_end(thread_slot(), replay->ids[dependencies[i]], group_id,
+                                  task_begin);
+        }
+    }
 }
@@ -2,13 +2,18 @@
 #define _TASKSYS_H
 
 #include "itasksys.h"
+#include "taskstats.h"
+#include "tasktrace.h"
+#include "cputopology.h"
+#include "elastic.h"
+#include "backpressure.h"
 #include <thread>
-#include <queue>
+#include <deque>
 #include <functional>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
-#include <map>
+#include <memory>
 
 /*
  * TaskSystemSerial: This class is the student's implementation of a
@@ -60,6 +65,24 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
         void sync();
 };
 
+/*
+ * How idle workers of TaskSystemParallelThreadPoolSleeping (and threads
+ * waiting in its sync()) wait for more work:
+ *  - IDLE_SLEEP: park on a condition variable right away.
+ *  - IDLE_SPIN: spin with pause and exponential backoff for the maximum
+ *    spin budget, then park.
+ *  - IDLE_ADAPTIVE: like IDLE_SPIN, but each thread sizes its budget from
+ *    how long it has recently had to wait for work, so it spins through
+ *    short gaps between launches and parks quickly across long ones. With
+ *    more workers than hardware threads it never spins, since a spinner
+ *    would only be taking time away from a thread with work to do.
+ */
+enum IdlePolicy {
+    IDLE_SLEEP,
+    IDLE_SPIN,
+    IDLE_ADAPTIVE,
+};
+
 /*
  * TaskSystemParallelThreadPoolSleeping: This class is the student's
  * optimized implementation of a parallel task execution engine that uses
@@ -68,45 +91,310 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
  */
 class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
 public:
-    explicit TaskSystemParallelThreadPoolSleeping(int num_threads);
+    // Workers are pinned to CPUs according to placement (see cputopology.h),
+    // and come and go between min and num_threads under bounds (see
+    // elastic.h). Submissions are held back under limits (see
+    // backpressure.h).
+    explicit TaskSystemParallelThreadPoolSleeping(
+        int num_threads, IdlePolicy idle_policy = IDLE_ADAPTIVE,
+        const ThreadPlacement& placement = ThreadPlacement(),
+        const ElasticBounds& bounds = ElasticBounds(),
+        const SubmissionLimits& limits = SubmissionLimits());
+    TaskSystemParallelThreadPoolSleeping(int num_threads, const ThreadPlacement& placement,
+                                         const ElasticBounds& bounds = ElasticBounds(),
+                                         const SubmissionLimits& limits = SubmissionLimits());
     ~TaskSystemParallelThreadPoolSleeping() override;
 
     const char* name() override;
     void run(IRunnable* runnable, int num_total_tasks) override;
-    TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) override;
+    void run(IRunnable* runnable, int num_total_tasks, const LaunchHints& hints) override;
+    TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                            const std::vector<TaskID>& deps) override;
+    TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                            const std::vector<TaskID>& deps, const LaunchHints& hints) override;
+    TaskID runAsyncWithTaskDeps(IRunnable* runnable, int num_total_tasks, TaskID dep,
+                                int block_size = 1) override;
     void sync() override;
+    void wait(TaskID task_id) override;
+    using ITaskSystem::wait;
+    bool poll(TaskID task_id) override;
+    TaskID then(TaskID task_id, IRunnable* runnable, int num_total_tasks) override;
+    void cancel(TaskID task_id) override;
+    void replay(const TaskGraph& graph) override;
+    std::vector<TaskID> submitBatch(const std::vector<BatchNode>& nodes) override;
+    void dumpStats() override;
+    void startTrace(const char* path) override;
 
 private:
+    struct TaskGroup;
+    struct GraphReplay;
+
+    // One edge of the task graph, owned by the dependent group.
+    struct DependencyEdge {
+        TaskGroup *dependent;
+        DependencyEdge *next;
+        TaskID prerequisite;
+    };
+
+    /*
+     * A bulk launch is queued once as a whole. Workers claim task indices
+     * from it in chunks through next_task; chunk_size grows for cheap
+     * tasks so that claiming overhead stays small relative to the work.
+     *
+     * Groups are carved out of fixed-size slabs, up to MAX_GROUPS of
+     * them, and recycled once they complete. A TaskID names a slot plus
+     * the generation of the group occupying it, so an ID that outlives
+     * its group simply no longer matches and is treated as finished. refs counts one reference for
+     * an unfinished group plus one per thread that has it pinned; the
+     * group is recycled when it drops to zero.
+     *
+     * dependents_head is a lock-free list of edges from groups waiting on
+     * this one. It is swapped for &closed_list when the group finishes, so
+     * a registration that loses the race sees the group as done. Groups
+     * launched by replay() additionally release the successors of their
+     * graph node.
+     *
+     * A group launched with runAsyncWithTaskDeps() is never queued. Its
+     * dependency registers itself in fine_successor, and block_pending
+     * counts the dependency's unfinished tasks in each block of
+     * block_size. Whoever finishes the last of them runs the block
+     * straight away, while its inputs are still in cache. fine_successor
+     * is closed with &no_fine_successor before the first task of a group
+     * runs, so a late registration falls back to waiting for the whole
+     * group.
+     *
+     * A group launched with then() is a continuation. Whoever finishes
+     * its prerequisite claims the continuation's first chunk and runs it
+     * straight away, and only queues the rest, if any, for the others.
+     *
+     * A cancelled group, or one found past its deadline, still goes
+     * through the queues, but run_range() checks before each task and
+     * skips the rest of whatever was claimed. The flag is passed on to each dependent before the
+     * dependent is released, which cancels the whole subgraph below it.
+     *
+     * A launch with the cache_affinity hint or SCHEDULE_STATIC is split
+     * into one home partition per worker, each with its own claim
+     * counter, and queued with every worker whose partition is not empty.
+     * Each worker claims from its own partition first, so task i keeps
+     * running on the same worker from launch to launch; a thief that
+     * takes the entry from a worker's deque claims from that worker's
+     * partition.
+     *
+     * Other schedules only change how much a claim takes: a whole
+     * partition under SCHEDULE_STATIC, min_chunk_size tasks under
+     * SCHEDULE_DYNAMIC, and a share of what is left under
+     * SCHEDULE_GUIDED, instead of the adaptive chunk_size. Under
+     * SCHEDULE_STATIC_INTERLEAVED, worker q's deque holds block q (tasks
+     * q, q + T, ...), which is claimed in one go.
+     *
+     * priority is the group's bottom level: the length of the longest
+     * path from it to the end of the graph, with each launch weighing as
+     * many waves of num_threads tasks as it needs. submitBatch() computes
+     * it over the whole batch, and replay() takes it from the bottom level
+     * the TaskGraph recorded, in tasks, as that many waves. A single
+     * launch starts at its own weight and raises the priorities of its
+     * prerequisites as it comes to depend on them, a bounded number of
+     * groups up the graph.
+     */
+    struct Partition {
+        std::atomic<int> next_task{0};
+        char padding[60]; // one claim counter per cache line
+    };
+
     struct TaskGroup {
-        TaskID id;
-        IRunnable *runnable;
-        int num_total_tasks;
-        std::atomic<int> tasks_remaining;
-        std::vector<TaskID> dependents;
-        std::atomic<int> outstanding_dependencies;
-
-        TaskGroup(const TaskID id, IRunnable* runnable, const int num_tasks)
-            : id(id), runnable(runnable), num_total_tasks(num_tasks),
-              tasks_remaining(num_tasks), outstanding_dependencies(0) {}
+        std::atomic<TaskID> id{0};
+        int slot = 0;
+        int generation = 0;
+        std::atomic<int> refs{0};
+        TaskGroup *next_free = nullptr;
+
+        IRunnable *runnable = nullptr;
+        int num_total_tasks = 0;
+        std::atomic<int> tasks_remaining{0};
+        std::atomic<DependencyEdge*> dependents_head{nullptr};
+        std::vector<DependencyEdge> edges;
+        std::atomic<int> outstanding_dependencies{0};
+        GraphReplay *replay = nullptr;
+        int graph_node = 0;
+        std::atomic<TaskGroup*> fine_successor{nullptr};
+        int block_size = 0;
+        std::unique_ptr<std::atomic<int>[]> block_pending;
+        int block_capacity = 0;
+        bool continuation = false;
+        std::atomic<bool> cancelled{false};
+        double deadline = 0;
+
+        std::atomic<int> next_task{0};
+        std::atomic<int> chunk_size{1};
+        int max_chunk_size = 1;
+        SchedulePolicy schedule = SCHEDULE_DEFAULT;
+        int min_chunk_size = 1;
+        bool partitioned = false;
+        std::unique_ptr<Partition[]> partitions;
+
+        std::atomic<int> weight{0};
+        std::atomic<int> priority{0};
+        int queue_priority = 0;
+        std::atomic<int> queue_id{-1};
     };
 
+    /*
+     * One in-flight replay of a TaskGraph: the group launched for each of
+     * its nodes. Dependency counts and successors come straight from the
+     * graph, and instances are recycled, so a steady stream of replays
+     * allocates nothing.
+     */
+    struct GraphReplay {
+        const TaskGraph *graph = nullptr;
+        std::vector<TaskGroup*> groups;
+        std::vector<TaskID> ids;
+        std::atomic<int> nodes_remaining{0};
+    };
+
+    static const int SLOT_BITS = 16;
+    static const int MAX_GROUPS = 1 << SLOT_BITS;
+    static const int GROUPS_PER_SLAB = 64;
+    static const int MAX_SLABS = MAX_GROUPS / GROUPS_PER_SLAB;
+
+    // The task indices begin, begin + stride, ... below end, claimed
+    // from a group.
+    struct TaskRange {
+        TaskGroup *group;
+        int begin;
+        int end;
+        int stride;
+    };
+
+    /*
+     * Each worker owns a deque of groups: it takes its own work from the
+     * back (LIFO) and thieves take from the front (FIFO). A group stays in
+     * its deque until its last chunk is claimed. The extra queue at index
+     * num_threads + n receives work submitted by threads outside the pool
+     * while they run on NUMA node n, and is only ever stolen from.
+     *
+     * Thieves try the queues of their own node before those of other
+     * nodes. Nodes are only known when workers are placed; otherwise
+     * everything is node 0.
+     *
+     * Each deque is kept in order of the priority its groups had when
+     * they were queued (queue_priority), highest at the back, and
+     * everyone takes from the run of highest-priority groups at the back:
+     * the owner its newest group, a thief the oldest one. A group whose
+     * priority is raised while it waits in a single deque (queue_id)
+     * moves up in it.
+     */
+    struct WorkerQueue {
+        std::mutex mtx;
+        std::deque<TaskGroup*> groups;
+        char padding[64]; // keep neighbouring queues off each other's cache lines
+    };
+
+    void worker_loop(int worker_id);
+    std::thread* start_worker(int worker_id);
+    bool retire_worker(int worker_id);
+    void grow(int num_tasks);
+    void push_by_priority(WorkerQueue& queue, TaskGroup* group);
+    void requeue_by_priority(TaskGroup* group);
+    bool claim_from(int queue_id, bool from_back, TaskRange& range);
+    bool claim_local(int worker_id, TaskRange& range);
+    bool steal(int thief_id, TaskRange& range);
+    int current_node() const;
+    void run_range(const TaskRange& range);
+    bool find_work(TaskRange& range);
+    void help_until(const std::function<bool()>& done);
+    int thread_slot() const;
+    ThreadStats& thread_stats();
+    void trace_dependencies_end(TaskGroup* group, double task_begin);
+
+    TaskID launch(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps,
+                  const LaunchHints& hints, OverloadPolicy policy);
+    bool admit(int num_groups, long long num_tasks, OverloadPolicy policy);
+    bool has_room(int num_groups, long long num_tasks) const;
+    TaskGroup* allocate_group(IRunnable* runnable, int num_total_tasks);
+    TaskGroup* take_free_group(std::unique_lock<std::mutex>& lock);
+    void take_free_groups(TaskGroup** groups, int count);
+    void wait_for_retired_group(std::unique_lock<std::mutex>& lock);
+    void reset_group(TaskGroup* group, IRunnable* runnable, int num_total_tasks);
+    TaskID submit_group(TaskGroup* group, const std::vector<TaskID>& deps);
+    void add_dependencies(TaskGroup* group, const std::vector<TaskID>& deps);
+    int launch_weight(int num_total_tasks) const;
+    void raise_priority(TaskGroup* group, int successor_priority);
+    static TaskGroup* close_fine_successor(TaskGroup* group);
+    static bool is_cancelled(TaskGroup* group);
+    TaskGroup* group_in_slot(TaskID id);
+    TaskGroup* pin_group(TaskID id);
+    void unpin_group(TaskGroup* group);
+    void recycle_group(TaskGroup* group);
+    static bool add_dependent(TaskGroup* group, DependencyEdge* edge);
+    GraphReplay* allocate_replay();
+    void recycle_replay(GraphReplay* replay);
+
+    int partition_begin(int num_total_tasks, int worker_id) const;
     void enqueue_tasks_for_group(TaskGroup* group);
-    void notify_dependents_of_completion(TaskGroup* group);
+    void enqueue_groups(const std::vector<TaskGroup*>& groups);
+    bool start_continuation(TaskGroup* group, TaskRange& range);
+    void wake_workers(int num_tasks);
+    TaskGroup* notify_dependents_of_completion(TaskGroup* group);
+
+    static DependencyEdge closed_list;
+    static TaskGroup no_fine_successor;
 
     std::thread **threads;
     const int num_threads;
-    std::queue<std::function<void()>> tasks;
+    const IdlePolicy idle_policy;
+    const ElasticBounds elastic;
+    const SubmissionLimits limits;
+    std::vector<int> worker_cpus;
+    TaskStats task_stats;
+    std::unique_ptr<TaskTrace> trace;
+    std::vector<int> cpu_nodes; // see cpu_node_table()
+    int num_nodes = 1;
+    std::vector<int> worker_nodes;
+    std::vector<std::vector<int>> node_queues;
+    WorkerQueue *queues;
+    std::atomic<int> num_queued{0};
+    std::atomic<int> num_sleeping{0};
     std::mutex mtx;
     std::condition_variable cv;
-    bool stop = false;
+    std::atomic<bool> stop{false};
+
+    // Workers of an elastic pool retire and start again under elastic_mtx,
+    // which guards worker_live. A retired worker's thread is joined when
+    // its slot is reused; threads[i] is null until worker i first starts.
+    std::mutex elastic_mtx;
+    std::unique_ptr<bool[]> worker_live;
+    std::atomic<int> num_live{0};
 
-    std::map<TaskID, std::unique_ptr<TaskGroup>> all_groups;
-    std::mutex graph_mtx;
-    std::atomic<TaskID> next_task_id{1};
+    // Slabs are published before num_slots so pin_group can read them
+    // without a lock. The free lists are guarded by free_mtx. Threads
+    // waiting for a slot help run work until num_retired moves, and are
+    // woken through sync_cv like those in sync().
+    std::atomic<TaskGroup*> slabs[MAX_SLABS];
+    std::atomic<int> num_slots{0};
+    std::mutex free_mtx;
+    TaskGroup *free_head = nullptr;
+    TaskGroup *free_tail = nullptr;
+    int num_free = 0;
+    int num_allocation_waiters = 0;
+    std::atomic<long long> num_retired{0};
+    std::vector<GraphReplay*> replays;
+    std::vector<GraphReplay*> free_replays;
 
+    // Threads blocked in sync() or wait() help run queued work, so they
+    // park on sync_cv (under mtx) and count towards num_sleeping as well.
     std::atomic<int> total_incomplete_groups{0};
-    std::mutex sync_mtx;
+    std::atomic<int> num_waiting{0};
     std::condition_variable sync_cv;
+
+    // Launches are admitted under admission_mtx when limits are set.
+    // tasks_in_flight counts the tasks of incomplete groups, and is only
+    // kept up to date when max_tasks is set. Completions that make room
+    // notify admission_cv when num_admission_waiters says someone is
+    // blocked on it.
+    std::atomic<long long> tasks_in_flight{0};
+    std::mutex admission_mtx;
+    std::condition_variable admission_cv;
+    std::atomic<int> num_admission_waiters{0};
 };
 
 #endif
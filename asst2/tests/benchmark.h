@@ -0,0 +1,223 @@
+#ifndef _BENCHMARK_H
+#define _BENCHMARK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CycleTimer.h"
+#include "itasksys.h"
+#include "tests.h"
+
+/*
+ * Benchmark mode of runtasks (-b), for regressions that the mean-time
+ * comparison of run_test_harness.py cannot see:
+ *
+ *  - a thread sweep runs one test on every task system with 1..N threads,
+ *    and reports the best time of each, with the speedup and efficiency
+ *    relative to the same task system on one thread;
+ *  - a launch latency benchmark times thousands of run() calls of empty
+ *    tasks one by one, and reports their mean (the per-launch overhead)
+ *    and p50/p99/p999 launch-to-completion latency;
+ *  - a wake-up latency benchmark does the same for launches that follow
+ *    an idle gap, long enough for workers to park (and, in an elastic
+ *    pool, retire), so it includes the time to get them going again. A
+ *    p99 above WAKE_LATENCY_BOUND is reported as a warning, since on a
+ *    loaded host it says more about the OS scheduler than the task
+ *    system; a bound given with -m is enforced instead.
+ *
+ * Results are written as JSON or CSV.
+ */
+
+typedef TestResults (*TestFunction)(ITaskSystem*);
+typedef ITaskSystem* (*TaskSystemFactory)(int impl, int num_threads);
+
+const int LATENCY_WARMUP_LAUNCHES = 100;
+const int LATENCY_SAMPLES = 10000;
+const int WAKE_SAMPLES = 20;
+const double WAKE_GAPS[] = {1e-3, 50e-3};
+const double WAKE_LATENCY_BOUND = 5e-3;
+
+struct SweepPoint {
+    std::string task_system;
+    int num_threads;
+    double seconds;
+    double speedup;
+    double efficiency;
+};
+
+struct LatencyResult {
+    std::string task_system;
+    int num_threads;
+    int num_tasks;
+    double gap;     // idle time before each launch; 0 for back-to-back launches
+    int samples;
+    double mean;
+    double p50;
+    double p99;
+    double p999;
+    double max;
+};
+
+class EmptyTask: public IRunnable {
+    public:
+        void runTask(int task_id, int num_total_tasks) {}
+};
+
+// Nearest-rank percentile of sorted samples.
+inline double percentile(const std::vector<double>& sorted, double fraction) {
+    size_t rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+/*
+ * Runs test on each of num_impls task systems with 1 to max_threads
+ * threads, keeping the best of num_iterations runs, each on a fresh task
+ * system. Returns false if any run fails its correctness check.
+ */
+inline bool sweep_threads(TestFunction test, TaskSystemFactory factory, int num_impls,
+                          int max_threads, int num_iterations, std::vector<SweepPoint>& points) {
+    for (int impl = 0; impl < num_impls; impl++) {
+        double one_thread_seconds = 0;
+        for (int num_threads = 1; num_threads <= max_threads; num_threads++) {
+            double best = 1e30;
+            std::string name;
+            for (int i = 0; i < num_iterations; i++) {
+                ITaskSystem *t = factory(impl, num_threads);
+                name = t->name();
+                TestResults result = test(t);
+                delete t;
+                if (!result.passed) {
+                    fprintf(stderr, "ERROR: Results did not pass correctness check! (threads=%d, ref_impl=%s)\n",
+                            num_threads, name.c_str());
+                    return false;
+                }
+                best = std::min(best, result.time);
+            }
+            if (num_threads == 1) {
+                one_thread_seconds = best;
+            }
+            const double speedup = one_thread_seconds / best;
+            points.push_back({name, num_threads, best, speedup, speedup / num_threads});
+        }
+    }
+    return true;
+}
+
+// Times num_samples launches, each after gap seconds of idling.
+inline LatencyResult measure_launch_latency(ITaskSystem* t, int num_threads, int num_tasks,
+                                            double gap = 0, int num_samples = LATENCY_SAMPLES) {
+    EmptyTask task;
+    for (int i = 0; i < LATENCY_WARMUP_LAUNCHES; i++) {
+        t->run(&task, num_tasks);
+    }
+
+    std::vector<double> samples(num_samples);
+    double total = 0;
+    for (int i = 0; i < num_samples; i++) {
+        if (gap > 0) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(gap));
+        }
+        const double start_time = CycleTimer::currentSeconds();
+        t->run(&task, num_tasks);
+        samples[i] = CycleTimer::currentSeconds() - start_time;
+        total += samples[i];
+    }
+    std::sort(samples.begin(), samples.end());
+
+    return {t->name(), num_threads, num_tasks, gap, num_samples, total / num_samples,
+            percentile(samples, 0.50), percentile(samples, 0.99), percentile(samples, 0.999),
+            samples.back()};
+}
+
+/*
+ * Launch latency of every task system with num_threads threads, for
+ * launches of a single task and of one task per thread, then wake-up
+ * latency for launches of one task per thread after each of WAKE_GAPS.
+ */
+inline void measure_launch_latencies(TaskSystemFactory factory, int num_impls, int num_threads,
+                                     std::vector<LatencyResult>& results) {
+    std::vector<int> task_counts = {1};
+    if (num_threads > 1) {
+        task_counts.push_back(num_threads);
+    }
+    for (int impl = 0; impl < num_impls; impl++) {
+        for (int num_tasks : task_counts) {
+            ITaskSystem *t = factory(impl, num_threads);
+            results.push_back(measure_launch_latency(t, num_threads, num_tasks));
+            delete t;
+        }
+        for (double gap : WAKE_GAPS) {
+            ITaskSystem *t = factory(impl, num_threads);
+            results.push_back(measure_launch_latency(t, num_threads, num_threads, gap, WAKE_SAMPLES));
+            delete t;
+        }
+    }
+}
+
+// Reports the wake-up measurements whose p99 exceeds bound, which only
+// count as a failure if enforce is set.
+inline bool check_wake_latencies(const std::vector<LatencyResult>& latencies, double bound, bool enforce) {
+    bool ok = true;
+    for (const LatencyResult &latency : latencies) {
+        if (latency.gap > 0 && latency.p99 > bound) {
+            fprintf(stderr, "%s: %s: p99 wake-up latency after %.0f ms idle is %.3f ms (bound %.3f ms)\n",
+                    enforce ? "ERROR" : "WARNING", latency.task_system.c_str(), latency.gap * 1e3,
+                    latency.p99 * 1e3, bound * 1e3);
+            ok = !enforce && ok;
+        }
+    }
+    return ok;
+}
+
+inline void write_benchmark_json(FILE* out, const char* test_name, const std::vector<SweepPoint>& points,
+                                 const std::vector<LatencyResult>& latencies) {
+    fprintf(out, "{\n");
+    if (test_name != NULL) {
+        fprintf(out, "  \"sweep\": {\n    \"test\": \"%s\",\n    \"points\": [", test_name);
+        for (size_t i = 0; i < points.size(); i++) {
+            const SweepPoint &point = points[i];
+            fprintf(out, "%s\n      {\"task_system\": \"%s\", \"threads\": %d, \"time_ms\": %.3f, "
+                         "\"speedup\": %.3f, \"efficiency\": %.3f}",
+                    i == 0 ? "" : ",", point.task_system.c_str(), point.num_threads,
+                    point.seconds * 1e3, point.speedup, point.efficiency);
+        }
+        fprintf(out, "\n    ]\n  },\n");
+    }
+    fprintf(out, "  \"launch_latency\": [");
+    for (size_t i = 0; i < latencies.size(); i++) {
+        const LatencyResult &latency = latencies[i];
+        fprintf(out, "%s\n    {\"task_system\": \"%s\", \"threads\": %d, \"tasks\": %d, \"gap_ms\": %.3f, "
+                     "\"samples\": %d, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+                     "\"p999_us\": %.3f, \"max_us\": %.3f}",
+                i == 0 ? "" : ",", latency.task_system.c_str(), latency.num_threads, latency.num_tasks,
+                latency.gap * 1e3, latency.samples, latency.mean * 1e6, latency.p50 * 1e6, latency.p99 * 1e6,
+                latency.p999 * 1e6, latency.max * 1e6);
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+// One table with a row per measurement; columns that do not apply to a
+// row are left empty.
+inline void write_benchmark_csv(FILE* out, const char* test_name, const std::vector<SweepPoint>& points,
+                                const std::vector<LatencyResult>& latencies) {
+    fprintf(out, "kind,test,task_system,threads,tasks,gap_ms,samples,time_ms,speedup,efficiency,"
+                 "mean_us,p50_us,p99_us,p999_us,max_us\n");
+    for (const SweepPoint &point : points) {
+        fprintf(out, "sweep,%s,%s,%d,,,,%.3f,%.3f,%.3f,,,,,\n", test_name, point.task_system.c_str(),
+                point.num_threads, point.seconds * 1e3, point.speedup, point.efficiency);
+    }
+    for (const LatencyResult &latency : latencies) {
+        fprintf(out, "launch_latency,,%s,%d,%d,%.3f,%d,,,,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                latency.task_system.c_str(), latency.num_threads, latency.num_tasks, latency.gap * 1e3,
+                latency.samples,
+                latency.mean * 1e6, latency.p50 * 1e6, latency.p99 * 1e6, latency.p999 * 1e6,
+                latency.max * 1e6);
+    }
+}
+
+#endif
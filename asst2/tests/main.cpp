@@ -6,16 +6,30 @@
 
 #include "tasksys.h"
 #include "tests.h"
+#include "benchmark.h"
 
 #define DEFAULT_NUM_THREADS 8
 #define DEFAULT_NUM_TIMING_ITERATIONS 3
+#define DEFAULT_RETIRE_AFTER_MS 10
 
 
 void usage(const char* progname, std::string *testnames, int num_tests) {
     printf("Usage: %s [options] testname\n", progname);
+    printf("       %s -b [options] [testname]\n", progname);
     printf("Program Options:\n");
     printf("  -n  --num_threads  <INT>      Number of threads: <INT> (default=%d)\n", DEFAULT_NUM_THREADS);
     printf("  -i  --num_timing_iterations <INT> Number of timing iterations: <INT> (default=%d)\n", DEFAULT_NUM_TIMING_ITERATIONS);
+    printf("  -s  --stats                   Print runtime statistics after each test (build with make STATS=1)\n");
+    printf("  -t  --trace <FILE>            Write a Chrome trace of each task system's last timing run to FILE\n");
+    printf("  -b  --benchmark               Measure launch and wake-up latency, and sweep testname over 1..num_threads threads\n");
+    printf("  -f  --format <json|csv>       Benchmark output format (default=json)\n");
+    printf("  -o  --output <FILE>           Write benchmark results to FILE instead of stdout\n");
+    printf("  -m  --max-wake <MS>           Fail the benchmark if a p99 wake-up latency exceeds MS ms (default: only warn)\n");
+    printf("  -p  --placement <POLICY>      Pin the sleeping pool's workers: compact, scatter, or a CPU list such as 0-3,8\n");
+    printf("  -e  --elastic <MIN[:MS]>      Let the sleeping pool retire workers idle for MS ms (default=%d), down to MIN\n",
+           DEFAULT_RETIRE_AFTER_MS);
+    printf("  -l  --limit <GROUPS[:TASKS]>  Cap the sleeping pool's unfinished launches at GROUPS, and their tasks at TASKS\n");
+    printf("  -w  --when-full <POLICY>      What a submission over the -l cap does: block (default), help, or reject\n");
     printf("  -?  --help                    This message\n");
     printf("Valid testnames are:");
     for(int i = 0; i < num_tests; i++) {
@@ -31,6 +45,75 @@ enum TaskSystemType {
     N_TASKSYS_IMPLS, // This must be in the last position.
 };
 
+// Where the workers of the thread pool that sleeps are placed (see -p).
+static ThreadPlacement thread_placement;
+
+bool parsePlacement(const std::string& arg, ThreadPlacement& placement) {
+    if (arg == "none") {
+        placement.policy = PLACEMENT_NONE;
+    } else if (arg == "compact") {
+        placement.policy = PLACEMENT_COMPACT;
+    } else if (arg == "scatter") {
+        placement.policy = PLACEMENT_SCATTER;
+    } else {
+        placement.policy = PLACEMENT_LIST;
+        placement.cpus = parse_cpu_list(arg);
+        return !placement.cpus.empty();
+    }
+    return true;
+}
+
+// How the thread pool that sleeps grows and shrinks (see -e).
+static ElasticBounds elastic_bounds;
+
+bool parseElastic(const std::string& arg, ElasticBounds& bounds) {
+    char *end;
+    bounds.min_threads = static_cast<int>(strtol(arg.c_str(), &end, 10));
+    int retire_after_ms = DEFAULT_RETIRE_AFTER_MS;
+    if (*end == ':') {
+        const char *ms_begin = end + 1;
+        retire_after_ms = static_cast<int>(strtol(ms_begin, &end, 10));
+        if (end == ms_begin) {
+            return false;
+        }
+    }
+    bounds.retire_after = retire_after_ms / 1000.0;
+    return *end == '\0' && bounds.min_threads > 0 && retire_after_ms > 0;
+}
+
+// How much unfinished work the thread pool that sleeps takes on (see -l
+// and -w).
+static SubmissionLimits submission_limits;
+
+bool parseLimits(const std::string& arg, SubmissionLimits& limits) {
+    char *end;
+    limits.max_groups = static_cast<int>(strtol(arg.c_str(), &end, 10));
+    if (end == arg.c_str()) {
+        return false;
+    }
+    if (*end == ':') {
+        const char *tasks_begin = end + 1;
+        limits.max_tasks = strtoll(tasks_begin, &end, 10);
+        if (end == tasks_begin) {
+            return false;
+        }
+    }
+    return *end == '\0' && limits.max_groups >= 0 && limits.max_tasks >= 0;
+}
+
+bool parseOverloadPolicy(const std::string& arg, SubmissionLimits& limits) {
+    if (arg == "block") {
+        limits.policy = OVERLOAD_BLOCK;
+    } else if (arg == "help") {
+        limits.policy = OVERLOAD_HELP;
+    } else if (arg == "reject") {
+        limits.policy = OVERLOAD_REJECT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
     assert(type < N_TASKSYS_IMPLS);
 
@@ -41,17 +124,80 @@ ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
     } else if (type == PARALLEL_THREAD_POOL_SPINNING) {
         return new TaskSystemParallelThreadPoolSpinning(num_threads);
     } else if (type == PARALLEL_THREAD_POOL_SLEEPING) {
-        return new TaskSystemParallelThreadPoolSleeping(num_threads);
+        return new TaskSystemParallelThreadPoolSleeping(num_threads, thread_placement, elastic_bounds,
+                                                        submission_limits);
     } else {
         return NULL;
     }
 }
 
+ITaskSystem *createTaskSystem(int impl, int num_threads) {
+    return selectTaskSystemRefImpl(num_threads, (TaskSystemType) impl);
+}
+
+int runBenchmark(const char* test_name, TestResults (**test)(ITaskSystem*), std::string *test_names,
+                 int num_tests, int num_threads, int num_timing_iterations,
+                 const std::string& format, const char* output_path, double max_wake_latency) {
+    if (format != "json" && format != "csv") {
+        fprintf(stderr, "Error: invalid benchmark format %s!\n", format.c_str());
+        return 1;
+    }
+
+    int test_id = -1;
+    if (test_name != NULL) {
+        for (int i = 0; i < num_tests; i++) {
+            if (test_names[i].compare(test_name) == 0) {
+                test_id = i;
+            }
+        }
+        if (test_id < 0) {
+            fprintf(stderr, "Error: invalid test_name!\n");
+            return 1;
+        }
+    }
+
+    std::vector<SweepPoint> points;
+    if (test_id >= 0 && !sweep_threads(test[test_id], createTaskSystem, N_TASKSYS_IMPLS, num_threads,
+                                       num_timing_iterations, points)) {
+        return 1;
+    }
+    std::vector<LatencyResult> latencies;
+    measure_launch_latencies(createTaskSystem, N_TASKSYS_IMPLS, num_threads, latencies);
+
+    FILE *out = stdout;
+    if (output_path != NULL) {
+        out = fopen(output_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error: could not open %s!\n", output_path);
+            return 1;
+        }
+    }
+    if (format == "json") {
+        write_benchmark_json(out, test_name, points, latencies);
+    } else {
+        write_benchmark_csv(out, test_name == NULL ? "" : test_name, points, latencies);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (max_wake_latency > 0) {
+        return check_wake_latencies(latencies, max_wake_latency, true) ? 0 : 1;
+    }
+    check_wake_latencies(latencies, WAKE_LATENCY_BOUND, false);
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
-    const int n_tests = 31;
+    const int n_tests = 56;
     int num_threads = DEFAULT_NUM_THREADS;
     int num_timing_iterations = DEFAULT_NUM_TIMING_ITERATIONS;
+    bool dump_stats = false;
+    const char *trace_path = NULL;
+    bool benchmark = false;
+    std::string benchmark_format = "json";
+    const char *benchmark_path = NULL;
+    double max_wake_latency = 0;
 
     TestResults (*test[n_tests])(ITaskSystem*) = {
         simpleTestSync,
@@ -83,6 +229,33 @@ int main(int argc, char** argv)
         strictGraphDepsSmall,
         strictGraphDepsMedium,
         strictGraphDepsLarge,
+        waitOnTaskTest,
+        graphReplayTest,
+        superLightTaskDepsTest,
+        pingPongUnequalTaskDepsTest,
+        cacheAffinityTest,
+        cacheAffinityBaselineTest,
+        nestedFibonacciTest,
+        parallelForReduceTest,
+        scanTest,
+        scanScalingTest,
+        pingPongUnequalStaticTest,
+        pingPongUnequalInterleavedTest,
+        pingPongUnequalDynamicTest,
+        pingPongUnequalGuidedTest,
+        mandelbrotChunkedStaticTest,
+        mandelbrotChunkedInterleavedTest,
+        mandelbrotChunkedDynamicTest,
+        mandelbrotChunkedGuidedTest,
+        futureThenTest,
+        cancelTest,
+        idleGapTest,
+        strictGraphDepsLargeBatch,
+        criticalPathTest,
+        runawaySubmissionTest,
+        taskIdReuseTest,
+        concurrentBatchTest,
+        criticalPathReplayTest,
     };
 
     std::string test_names[n_tests] = {
@@ -115,6 +288,33 @@ int main(int argc, char** argv)
         "strict_graph_deps_small_async",
         "strict_graph_deps_med_async",
         "strict_graph_deps_large_async",
+        "wait_on_task_async",
+        "graph_replay_async",
+        "super_light_task_deps_async",
+        "ping_pong_unequal_task_deps_async",
+        "cache_affinity",
+        "cache_affinity_baseline",
+        "nested_fibonacci",
+        "parallel_for_reduce",
+        "scan",
+        "scan_scaling",
+        "ping_pong_unequal_static",
+        "ping_pong_unequal_interleaved",
+        "ping_pong_unequal_dynamic",
+        "ping_pong_unequal_guided",
+        "mandelbrot_chunked_static",
+        "mandelbrot_chunked_interleaved",
+        "mandelbrot_chunked_dynamic",
+        "mandelbrot_chunked_guided",
+        "future_then_async",
+        "cancel_async",
+        "idle_gap",
+        "strict_graph_deps_large_batch_async",
+        "critical_path_async",
+        "runaway_submission_async",
+        "task_id_reuse_async",
+        "concurrent_batch_async",
+        "critical_path_replay_async",
     };
  
     // Parse commandline options
@@ -122,10 +322,20 @@ int main(int argc, char** argv)
     static struct option long_options[] = {
         {"num_threads",           1, 0,  'n'},
         {"num_timing_iterations", 1, 0,  'i'},
+        {"stats",                 0, 0,  's'},
+        {"trace",                 1, 0,  't'},
+        {"benchmark",             0, 0,  'b'},
+        {"format",                1, 0,  'f'},
+        {"output",                1, 0,  'o'},
+        {"max-wake",              1, 0,  'm'},
+        {"placement",             1, 0,  'p'},
+        {"elastic",               1, 0,  'e'},
+        {"limit",                 1, 0,  'l'},
+        {"when-full",             1, 0,  'w'},
         {"help",                  0, 0,  '?'},
     };
 
-    while ((opt = getopt_long(argc, argv, "n:i:?", long_options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "n:i:st:bf:o:m:p:e:l:w:?", long_options, NULL)) != EOF) {
 
         switch (opt) {
         case 'n':
@@ -134,6 +344,52 @@ int main(int argc, char** argv)
         case 'i':
             num_timing_iterations = atoi(optarg);
             break;
+        case 's':
+            dump_stats = true;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'b':
+            benchmark = true;
+            break;
+        case 'f':
+            benchmark_format = optarg;
+            break;
+        case 'o':
+            benchmark_path = optarg;
+            break;
+        case 'm':
+            max_wake_latency = atof(optarg) * 1e-3;
+            if (max_wake_latency <= 0) {
+                fprintf(stderr, "Error: invalid wake-up latency bound %s!\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            if (!parsePlacement(optarg, thread_placement)) {
+                fprintf(stderr, "Error: invalid placement %s!\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (!parseElastic(optarg, elastic_bounds)) {
+                fprintf(stderr, "Error: invalid elastic bounds %s!\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            if (!parseLimits(optarg, submission_limits)) {
+                fprintf(stderr, "Error: invalid limit %s!\n", optarg);
+                return 1;
+            }
+            break;
+        case 'w':
+            if (!parseOverloadPolicy(optarg, submission_limits)) {
+                fprintf(stderr, "Error: invalid overload policy %s!\n", optarg);
+                return 1;
+            }
+            break;
         case '?':
         default:
             usage(argv[0], test_names, n_tests);
@@ -141,6 +397,11 @@ int main(int argc, char** argv)
         }
     }
 
+    if (benchmark) {
+        return runBenchmark(optind < argc ? argv[optind] : NULL, test, test_names, n_tests, num_threads,
+                            num_timing_iterations, benchmark_format, benchmark_path, max_wake_latency);
+    }
+
     if (optind + 1 > argc) {
         fprintf(stderr, "Error: missing test_name!\n");
         usage(argv[0], test_names, n_tests);
@@ -168,6 +429,9 @@ int main(int argc, char** argv)
 
                 // Create a new task system
                 ITaskSystem *t = selectTaskSystemRefImpl(num_threads, (TaskSystemType) i);
+                if (trace_path != NULL && j+1 == num_timing_iterations) {
+                    t->startTrace(trace_path);
+                }
 
                 // Run test
                 TestResults result = test[test_id](t);
@@ -184,6 +448,9 @@ int main(int argc, char** argv)
                 // TODO: do this better
                 if( j+1 == num_timing_iterations) {
                     printf("[%s]:\t\t[%.3f] ms\n", t->name(), minT * 1000);
+                    if (dump_stats) {
+                        t->dumpStats();
+                    }
                 }
 
                 // Shutdown task system so each timing run is from a clean start
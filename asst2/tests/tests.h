@@ -1,3 +1,6 @@
+#ifndef _TESTS_H
+#define _TESTS_H
+
 #include <chrono>
 #include <cmath>
 #include <math.h>
@@ -6,15 +9,24 @@
 #include <thread>
 #include <atomic>
 #include <set>
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <unistd.h>
 
 #include "CycleTimer.h"
 #include "itasksys.h"
+#include "parallel.h"
 
 /*
 Sync tests
 ==========
 TestResults pingPongEqualTest(ITaskSystem *t);
 TestResults pingPongUnequalTest(ITaskSystem *t);
+TestResults pingPongUnequalStaticTest(ITaskSystem *t);
+TestResults pingPongUnequalInterleavedTest(ITaskSystem *t);
+TestResults pingPongUnequalDynamicTest(ITaskSystem *t);
+TestResults pingPongUnequalGuidedTest(ITaskSystem *t);
 TestResults superLightTest(ITaskSystem *t);
 TestResults superSuperLightTest(ITaskSystem *t);
 TestResults recursiveFibonacciTest(ITaskSystem* t);
@@ -23,6 +35,16 @@ TestResults mathOperationsInTightForLoopFanInTest(ITaskSystem* t);
 TestResults mathOperationsInTightForLoopReductionTreeTest(ITaskSystem* t);
 TestResults spinBetweenRunCallsTest(ITaskSystem *t);
 TestResults mandelbrotChunkedTest(ITaskSystem* t);
+TestResults mandelbrotChunkedStaticTest(ITaskSystem* t);
+TestResults mandelbrotChunkedInterleavedTest(ITaskSystem* t);
+TestResults mandelbrotChunkedDynamicTest(ITaskSystem* t);
+TestResults mandelbrotChunkedGuidedTest(ITaskSystem* t);
+TestResults cacheAffinityTest(ITaskSystem* t);
+TestResults cacheAffinityBaselineTest(ITaskSystem* t);
+TestResults parallelForReduceTest(ITaskSystem* t);
+TestResults scanTest(ITaskSystem* t);
+TestResults scanScalingTest(ITaskSystem* t);
+TestResults idleGapTest(ITaskSystem* t);
 
 Async with dependencies tests
 =============================
@@ -37,6 +59,18 @@ TestResults mathOperationsInTightForLoopReductionTreeAsyncTest(ITaskSystem* t);
 TestResults spinBetweenRunCallsAsyncTest(ITaskSystem *t);
 TestResults mandelbrotChunkedAsyncTest(ITaskSystem* t);
 TestResults simpleRunDepsTest(ITaskSystem *t);
+TestResults waitOnTaskTest(ITaskSystem *t);
+TestResults futureThenTest(ITaskSystem *t);
+TestResults cancelTest(ITaskSystem *t);
+TestResults criticalPathTest(ITaskSystem *t);
+TestResults criticalPathReplayTest(ITaskSystem *t);
+TestResults runawaySubmissionTest(ITaskSystem *t);
+TestResults taskIdReuseTest(ITaskSystem *t);
+TestResults concurrentBatchTest(ITaskSystem *t);
+TestResults graphReplayTest(ITaskSystem *t);
+TestResults nestedFibonacciTest(ITaskSystem *t);
+TestResults superLightTaskDepsTest(ITaskSystem *t);
+TestResults pingPongUnequalTaskDepsTest(ITaskSystem *t);
 */
 
 /*
@@ -227,6 +261,52 @@ class RecursiveFibonacciTask: public IRunnable {
         }
 };
 
+/*
+ * Computes the same Fibonacci numbers, but above a cutoff each task
+ * recurses through the task system itself: it launches the two smaller
+ * subproblems as a bulk launch of two tasks and waits for them from inside
+ * runTask(), alternating between run() and runAsyncWithDeps() + sync()
+ * from one level to the next.
+ */
+class NestedFibonacciTask: public IRunnable {
+    public:
+        ITaskSystem* t_;
+        int idx_[2];
+        int output_[2];
+        static const int serial_cutoff = 16;
+
+        NestedFibonacciTask(ITaskSystem* t, int idx0, int idx1) : t_(t) {
+            idx_[0] = idx0;
+            idx_[1] = idx1;
+            output_[0] = 0;
+            output_[1] = 0;
+        }
+        ~NestedFibonacciTask() {}
+
+        static int slowFn(int n) {
+            if (n < 2) return 1;
+            return slowFn(n-1) + slowFn(n-2);
+        }
+
+        void runTask(int task_id, int num_total_tasks) {
+            int n = idx_[task_id];
+            if (n < serial_cutoff) {
+                output_[task_id] = slowFn(n);
+                return;
+            }
+
+            NestedFibonacciTask child(t_, n-1, n-2);
+            if (n % 2 == 0) {
+                t_->run(&child, 2);
+            } else {
+                std::vector<TaskID> no_deps;
+                t_->runAsyncWithDeps(&child, 2, no_deps);
+                t_->sync();
+            }
+            output_[task_id] = child.output_[0] + child.output_[1];
+        }
+};
+
 /*
  * Each task copies its task id into the output.
  */
@@ -488,6 +568,201 @@ class StrictDependencyTask: public IRunnable {
         ~StrictDependencyTask() {}
 };
 
+/*
+ * The counterpart of StrictDependencyTask for a task graph that is run
+ * over and over: each complete run of the bulk task launch is one frame,
+ * and the first task of a frame checks that every dependency has already
+ * finished that same frame.
+ */
+class FrameDependencyTask: public IRunnable {
+    private:
+        const std::vector<FrameDependencyTask*>& deps_;
+        std::atomic<int> tasks_started_;
+        std::atomic<int> tasks_ended_;
+        std::atomic<int> frames_done_;
+        bool satisfied_;
+
+    public:
+        FrameDependencyTask(const std::vector<FrameDependencyTask*>& deps)
+          : deps_(deps), tasks_started_(0), tasks_ended_(0), frames_done_(0),
+            satisfied_(true) {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int entry_id = tasks_started_++;
+            if (entry_id == 0) {
+                satisfied_ = satisfied_ && depsMet();
+            }
+
+            doWork(task_id);
+
+            int exit_id = ++tasks_ended_;
+            // Every task of this frame has started by now, so the counters
+            // can be reset for the next one.
+            if (exit_id == num_total_tasks) {
+                tasks_started_ = 0;
+                tasks_ended_ = 0;
+                frames_done_++;
+            }
+        }
+
+        bool depsMet() {
+            for (FrameDependencyTask *dep : deps_) {
+                if (dep->frames_done_ != frames_done_ + 1) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void doWork(int task_id) {
+            volatile float x = 1.0f;
+            for (int i = 0; i < 200 * (1 + task_id % 10); i++) {
+                x = x * 0.999f + 0.001f;
+            }
+        }
+
+        bool passed(int num_frames) {
+            return satisfied_ && frames_done_ == num_frames;
+        }
+        ~FrameDependencyTask() {}
+};
+
+/*
+ * Each task applies x = x * scale + offset in-place to its slice of the
+ * array, so every launch of the same task reads and writes task i's slice
+ * again.
+ */
+class ScaleOffsetTask: public IRunnable {
+    public:
+        int num_elements_;
+        float* array_;
+        float scale_;
+        float offset_;
+
+        ScaleOffsetTask(int num_elements, float* array, float scale, float offset)
+            : num_elements_(num_elements), array_(array), scale_(scale),
+              offset_(offset) {}
+        ~ScaleOffsetTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int elements_per_task = (num_elements_ + num_total_tasks-1) / num_total_tasks;
+            int start_el = elements_per_task * task_id;
+            int end_el = std::min(start_el + elements_per_task, num_elements_);
+
+            for (int i=start_el; i<end_el; i++)
+                array_[i] = array_[i] * scale_ + offset_;
+        }
+};
+
+/*
+ * Each task sleeps for sleep_us_ microseconds and counts itself in
+ * num_run_.
+ */
+class CountedSleepTask: public IRunnable {
+    public:
+        int sleep_us_;
+        std::atomic<int> num_run_;
+
+        CountedSleepTask(int sleep_us): sleep_us_(sleep_us), num_run_(0) {}
+        ~CountedSleepTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            std::this_thread::sleep_for(std::chrono::microseconds(sleep_us_));
+            num_run_++;
+        }
+};
+
+/*
+ * Each task sleeps for sleep_us_ microseconds and then counts itself in
+ * *done_. The first task to start notes what *watched_ was at that point
+ * in watched_at_start_.
+ */
+class WatchedSleepTask: public IRunnable {
+    public:
+        int sleep_us_;
+        std::atomic<int>* done_;
+        const std::atomic<int>* watched_;
+        std::atomic<int> watched_at_start_;
+
+        WatchedSleepTask(int sleep_us, std::atomic<int>* done, const std::atomic<int>* watched)
+            : sleep_us_(sleep_us), done_(done), watched_(watched), watched_at_start_(-1) {}
+        ~WatchedSleepTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int unseen = -1;
+            watched_at_start_.compare_exchange_strong(unseen, watched_->load());
+            std::this_thread::sleep_for(std::chrono::microseconds(sleep_us_));
+            done_->fetch_add(1);
+        }
+};
+
+/*
+ * A single task that waits until open_ is set, unless it runs on the
+ * thread that launched it: a task system that runs launches inline would
+ * never get to set it.
+ */
+class HeldTask: public IRunnable {
+    public:
+        std::thread::id submitter_;
+        std::atomic<bool> open_;
+        std::atomic<int> num_run_;
+
+        HeldTask(): submitter_(std::this_thread::get_id()), open_(false), num_run_(0) {}
+        ~HeldTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            while (std::this_thread::get_id() != submitter_ && !open_.load()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            num_run_++;
+        }
+};
+
+/*
+ * One step of a chain of launches: each task checks that every task of
+ * the previous step has finished, then counts itself in done_[step_].
+ */
+class ChainStepTask: public IRunnable {
+    public:
+        std::atomic<int>* done_;
+        int step_;
+        int num_previous_tasks_;
+        std::atomic<bool>* in_order_;
+
+        ChainStepTask(std::atomic<int>* done, int step, int num_previous_tasks,
+                      std::atomic<bool>* in_order)
+            : done_(done), step_(step), num_previous_tasks_(num_previous_tasks),
+              in_order_(in_order) {}
+        ~ChainStepTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            if (step_ > 0 && done_[step_ - 1].load() != num_previous_tasks_) {
+                in_order_->store(false);
+            }
+            done_[step_]++;
+        }
+};
+
+/*
+ * Each task submits a copy of nodes_ as one batch from inside the task
+ * system, and keeps the TaskIDs it gets back.
+ */
+class BatchSubmitTask: public IRunnable {
+    public:
+        ITaskSystem* t_;
+        const std::vector<BatchNode>* nodes_;
+        std::vector<TaskID>* task_ids_;
+
+        BatchSubmitTask(ITaskSystem* t, const std::vector<BatchNode>* nodes,
+                        std::vector<TaskID>* task_ids)
+            : t_(t), nodes_(nodes), task_ids_(task_ids) {}
+        ~BatchSubmitTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            task_ids_[task_id] = t_->submitBatch(*nodes_);
+        }
+};
+
 /* 
  * ==================================================================
  *   Begin test definitions
@@ -585,7 +860,9 @@ TestResults simpleTestAsync(ITaskSystem* t) {
  * and does O(base_iters) work per element.
  */
 TestResults pingPongTest(ITaskSystem* t, bool equal_work, bool do_async,
-                         int num_elements, int base_iters) {
+                         int num_elements, int base_iters,
+                         int task_dep_block_size = 0,
+                         const LaunchHints& hints = LaunchHints()) {
 
     int num_tasks = 64;
     int num_bulk_task_launches = 400;   
@@ -620,13 +897,21 @@ TestResults pingPongTest(ITaskSystem* t, bool equal_work, bool do_async,
     for (int i=0; i<num_bulk_task_launches; i++) {
         if (do_async) {
             std::vector<TaskID> deps;
+            if (i > 0 && task_dep_block_size > 0) {
+                // Task j only touches the elements that task j of the
+                // previous launch wrote.
+                prev_task_id = t->runAsyncWithTaskDeps(
+                    runnables[i], num_tasks, prev_task_id,
+                    task_dep_block_size);
+                continue;
+            }
             if (i > 0) {
                 deps.push_back(prev_task_id);
             }
             prev_task_id = t->runAsyncWithDeps(
-                runnables[i], num_tasks, deps);
+                runnables[i], num_tasks, deps, hints);
         } else {
-            t->run(runnables[i], num_tasks);
+            t->run(runnables[i], num_tasks, hints);
         }
     }
     if (do_async)
@@ -713,6 +998,53 @@ TestResults pingPongUnequalAsyncTest(ITaskSystem* t) {
     return pingPongTest(t, false, true, num_elements, base_iters);
 }
 
+/*
+ * The same chains with per-task dependencies between consecutive launches:
+ * one block of 4 tasks at a time for the light chain, task by task for the
+ * unequal one.
+ */
+TestResults superLightTaskDepsTest(ITaskSystem* t) {
+    int num_elements = 32 * 1024;
+    int base_iters = 32;
+    return pingPongTest(t, true, true, num_elements, base_iters, 4);
+}
+
+TestResults pingPongUnequalTaskDepsTest(ITaskSystem* t) {
+    int num_elements = 512 * 1024;
+    int base_iters = 32;
+    return pingPongTest(t, false, true, num_elements, base_iters, 1);
+}
+
+/*
+ * The unequal chain under each SchedulePolicy. Its cost grows with the
+ * task index, so the static schedules show how much a fixed division of
+ * the work costs against handing it out on demand.
+ */
+TestResults pingPongUnequalScheduleTest(ITaskSystem* t, SchedulePolicy schedule, int chunk_size) {
+    int num_elements = 512 * 1024;
+    int base_iters = 32;
+    LaunchHints hints;
+    hints.schedule = schedule;
+    hints.chunk_size = chunk_size;
+    return pingPongTest(t, false, false, num_elements, base_iters, 0, hints);
+}
+
+TestResults pingPongUnequalStaticTest(ITaskSystem* t) {
+    return pingPongUnequalScheduleTest(t, SCHEDULE_STATIC, 0);
+}
+
+TestResults pingPongUnequalInterleavedTest(ITaskSystem* t) {
+    return pingPongUnequalScheduleTest(t, SCHEDULE_STATIC_INTERLEAVED, 0);
+}
+
+TestResults pingPongUnequalDynamicTest(ITaskSystem* t) {
+    return pingPongUnequalScheduleTest(t, SCHEDULE_DYNAMIC, 2);
+}
+
+TestResults pingPongUnequalGuidedTest(ITaskSystem* t) {
+    return pingPongUnequalScheduleTest(t, SCHEDULE_GUIDED, 1);
+}
+
 /*
  * Computation: The following tests compute Fibonacci numbers using
  * recursion. Since the tasks are compute intensive, the tests show
@@ -1177,7 +1509,8 @@ TestResults spinBetweenRunCallsAsyncTest(ITaskSystem *t) {
  * which means thread pool and spawning threads each run() should have
  * similar performance.
  */
-TestResults mandelbrotChunkedTestBase(ITaskSystem* t, bool do_async) {
+TestResults mandelbrotChunkedTestBase(ITaskSystem* t, bool do_async,
+                                      const LaunchHints& hints = LaunchHints()) {
 
     int num_tasks = 128;
     
@@ -1200,10 +1533,10 @@ TestResults mandelbrotChunkedTestBase(ITaskSystem* t, bool do_async) {
     double start_time = CycleTimer::currentSeconds();
     if (do_async) {
         std::vector<TaskID> deps; // Call runAsyncWithDeps without dependencies.
-        t->runAsyncWithDeps(&mandel_task, num_tasks, deps);
+        t->runAsyncWithDeps(&mandel_task, num_tasks, deps, hints);
         t->sync();
     } else {
-        t->run(&mandel_task, num_tasks);
+        t->run(&mandel_task, num_tasks, hints);
     }
     double end_time = CycleTimer::currentSeconds();
 
@@ -1240,6 +1573,280 @@ TestResults mandelbrotChunkedAsyncTest(ITaskSystem* t) {
     return mandelbrotChunkedTestBase(t, true);
 }
 
+/*
+ * The rows near the middle of the image are the most expensive, so a
+ * static division into contiguous blocks leaves the threads with very
+ * different amounts of work.
+ */
+TestResults mandelbrotChunkedScheduleTest(ITaskSystem* t, SchedulePolicy schedule, int chunk_size) {
+    LaunchHints hints;
+    hints.schedule = schedule;
+    hints.chunk_size = chunk_size;
+    return mandelbrotChunkedTestBase(t, false, hints);
+}
+
+TestResults mandelbrotChunkedStaticTest(ITaskSystem* t) {
+    return mandelbrotChunkedScheduleTest(t, SCHEDULE_STATIC, 0);
+}
+
+TestResults mandelbrotChunkedInterleavedTest(ITaskSystem* t) {
+    return mandelbrotChunkedScheduleTest(t, SCHEDULE_STATIC_INTERLEAVED, 0);
+}
+
+TestResults mandelbrotChunkedDynamicTest(ITaskSystem* t) {
+    return mandelbrotChunkedScheduleTest(t, SCHEDULE_DYNAMIC, 4);
+}
+
+TestResults mandelbrotChunkedGuidedTest(ITaskSystem* t) {
+    return mandelbrotChunkedScheduleTest(t, SCHEDULE_GUIDED, 1);
+}
+
+/*
+ * Computation: many back-to-back launches of a cheap elementwise update
+ * over an array too large for one core's caches but small enough to fit
+ * when split across the cores. The work per element is tiny, so the time
+ * is dominated by where each slice comes from: with the cache_affinity
+ * hint, task i keeps running on the same worker and finds its slice in
+ * that worker's cache; without it, slices travel between cores.
+ */
+TestResults cacheAffinityTestBase(ITaskSystem* t, bool cache_affinity) {
+    int num_elements = 2 * 1024 * 1024;
+    int num_tasks = 256;
+    int num_bulk_task_launches = 200;
+
+    float* array = new float[num_elements];
+    for (int i = 0; i < num_elements; i++) {
+        array[i] = i % 7;
+    }
+
+    ScaleOffsetTask task(num_elements, array, 0.5f, 1.0f);
+    LaunchHints hints;
+    hints.cache_affinity = cache_affinity;
+
+    double start_time = CycleTimer::currentSeconds();
+    for (int i = 0; i < num_bulk_task_launches; i++) {
+        t->run(&task, num_tasks, hints);
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    float expected[7];
+    for (int k = 0; k < 7; k++) {
+        expected[k] = k;
+        for (int j = 0; j < num_bulk_task_launches; j++) {
+            expected[k] = expected[k] * 0.5f + 1.0f;
+        }
+    }
+
+    TestResults result;
+    result.passed = true;
+    for (int i = 0; i < num_elements; i++) {
+        if (array[i] != expected[i % 7]) {
+            printf("%d: %f expected=%f\n", i, array[i], expected[i % 7]);
+            result.passed = false;
+            break;
+        }
+    }
+    result.time = end_time - start_time;
+
+    delete [] array;
+    return result;
+}
+
+TestResults cacheAffinityTest(ITaskSystem* t) {
+    return cacheAffinityTestBase(t, true);
+}
+
+TestResults cacheAffinityBaselineTest(ITaskSystem* t) {
+    return cacheAffinityTestBase(t, false);
+}
+
+/*
+ * Computation: a saxpy written with parallel_for, followed by two
+ * reductions over its output with parallel_reduce: an exact integer sum
+ * with the automatic grain, and an order-sensitive one (the index of the
+ * first maximum) with an explicit grain.
+ */
+TestResults parallelForReduceTest(ITaskSystem* t) {
+    int num_elements = 4 * 1024 * 1024;
+    int num_iterations = 10;
+
+    int* x = new int[num_elements];
+    int* y = new int[num_elements];
+    for (int i = 0; i < num_elements; i++) {
+        x[i] = i % 1000;
+        y[i] = i % 7;
+    }
+
+    long long sum = 0;
+    long long first_max = -1;
+    double start_time = CycleTimer::currentSeconds();
+    for (int iter = 0; iter < num_iterations; iter++) {
+        parallel_for(t, 0, num_elements, [&](long long i) {
+            y[i] = 3 * x[i] + y[i];
+        });
+        sum = parallel_reduce(t, 0, num_elements, 0LL,
+            [&](long long i) { return static_cast<long long>(y[i]); },
+            [](long long a, long long b) { return a + b; });
+        first_max = parallel_reduce(t, 0, num_elements, 4096, -1LL,
+            [](long long i) { return i; },
+            [&](long long a, long long b) {
+                return (a < 0 || (b >= 0 && y[b] > y[a])) ? b : a;
+            });
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    long long expected_sum = 0;
+    long long expected_first_max = 0;
+    for (int i = 0; i < num_elements; i++) {
+        long long expected_y = 3LL * num_iterations * (i % 1000) + (i % 7);
+        expected_sum += expected_y;
+        if (expected_y > 3LL * num_iterations * (expected_first_max % 1000) + (expected_first_max % 7)) {
+            expected_first_max = i;
+        }
+    }
+
+    TestResults result;
+    result.passed = true;
+    if (sum != expected_sum) {
+        printf("sum: %lld expected=%lld\n", sum, expected_sum);
+        result.passed = false;
+    }
+    if (first_max != expected_first_max) {
+        printf("first max: %lld expected=%lld\n", first_max, expected_first_max);
+        result.passed = false;
+    }
+    result.time = end_time - start_time;
+
+    delete [] x;
+    delete [] y;
+    return result;
+}
+
+/*
+ * Runs one inclusive or exclusive parallel scan of n elements, in place or
+ * not, and checks it against a serial scan. Inputs are small multiples of
+ * scale, so that float sums stay exact whatever order they are added in.
+ */
+template <typename T>
+bool scanTestBase(ITaskSystem* t, long long n, T scale, bool inclusive, bool in_place) {
+    std::vector<T> input(n);
+    std::vector<T> output(n);
+    for (long long i = 0; i < n; i++) {
+        input[i] = static_cast<T>(i % 4) * scale;
+    }
+
+    if (in_place) {
+        output = input;
+    }
+    const T* source = in_place ? output.data() : input.data();
+    if (inclusive) {
+        parallel_inclusive_scan(t, source, output.data(), n);
+    } else {
+        parallel_exclusive_scan(t, source, output.data(), n);
+    }
+
+    T running = 0;
+    for (long long i = 0; i < n; i++) {
+        if (inclusive) {
+            running += input[i];
+        }
+        if (output[i] != running) {
+            printf("n=%lld %s%s: %lld: %f expected=%f\n", n,
+                   inclusive ? "inclusive" : "exclusive", in_place ? " in place" : "",
+                   i, static_cast<double>(output[i]), static_cast<double>(running));
+            return false;
+        }
+        if (!inclusive) {
+            running += input[i];
+        }
+    }
+    return true;
+}
+
+/*
+ * Computation: inclusive and exclusive prefix sums of int, float and 64-bit
+ * integer arrays, both in place and out of place, at sizes from a single
+ * element to a few million.
+ */
+TestResults scanTest(ITaskSystem* t) {
+    long long sizes[] = {1, 1000, 1000003, 4 * 1024 * 1024};
+
+    TestResults result;
+    result.passed = true;
+    double start_time = CycleTimer::currentSeconds();
+    for (long long n : sizes) {
+        for (int mode = 0; mode < 4; mode++) {
+            bool inclusive = (mode & 1) != 0;
+            bool in_place = (mode & 2) != 0;
+            result.passed = result.passed &&
+                scanTestBase<int>(t, n, 1, inclusive, in_place) &&
+                scanTestBase<float>(t, n, 1.0f, inclusive, in_place) &&
+                scanTestBase<long long>(t, n, 1LL << 32, inclusive, in_place);
+        }
+    }
+    double end_time = CycleTimer::currentSeconds();
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Times one in-place inclusive scan of n elements and prints its
+ * throughput. Sizes that would need more than a quarter of physical memory
+ * are skipped.
+ */
+template <typename T>
+bool scanScalingTestBase(ITaskSystem* t, long long n, const char* type_name, double* total_time) {
+    long long physical_bytes = static_cast<long long>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+    if (static_cast<long long>(n * sizeof(T)) > physical_bytes / 4) {
+        printf("[%s] scan %-9s n=%-10lld skipped (too large for this machine)\n", t->name(), type_name, n);
+        return true;
+    }
+    T* array = new (std::nothrow) T[n];
+    if (array == NULL) {
+        printf("[%s] scan %-9s n=%-10lld skipped (allocation failed)\n", t->name(), type_name, n);
+        return true;
+    }
+    for (long long i = 0; i < n; i++) {
+        array[i] = static_cast<T>(i % 2);
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    parallel_inclusive_scan(t, array, array, n);
+    double end_time = CycleTimer::currentSeconds();
+    *total_time += end_time - start_time;
+    printf("[%s] scan %-9s n=%-10lld %10.3f ms %8.3f Gelem/s\n", t->name(), type_name, n,
+           (end_time - start_time) * 1000, n / (end_time - start_time) / 1e9);
+
+    // The input alternates 0, 1, so the last prefix sum is n / 2. Float sums
+    // past 2^24 are rounded, so only integer scans can be checked.
+    bool passed = !std::numeric_limits<T>::is_integer || array[n - 1] == static_cast<T>(n / 2);
+    if (!passed) {
+        printf("%lld: %f expected=%f\n", n - 1, static_cast<double>(array[n - 1]),
+               static_cast<double>(static_cast<T>(n / 2)));
+    }
+    delete [] array;
+    return passed;
+}
+
+/*
+ * Benchmark: in-place inclusive scans of int, float and 64-bit integer
+ * arrays of 1M, 10M, 100M and 1B elements. The reported time is the sum
+ * over all scans that fit in memory.
+ */
+TestResults scanScalingTest(ITaskSystem* t) {
+    long long sizes[] = {1000000, 10000000, 100000000, 1000000000};
+
+    TestResults result;
+    result.passed = true;
+    result.time = 0;
+    for (long long n : sizes) {
+        result.passed = scanScalingTestBase<int>(t, n, "int", &result.time) && result.passed;
+        result.passed = scanScalingTestBase<float>(t, n, "float", &result.time) && result.passed;
+        result.passed = scanScalingTestBase<long long>(t, n, "long long", &result.time) && result.passed;
+    }
+    return result;
+}
+
 /*
  * Computation: Simple correctness test for runAsyncWithDeps.
  * Tasks sleep for a prescribed amount of time and then print
@@ -1337,7 +1944,7 @@ TestResults strictDiamondDepsTest(ITaskSystem *t) {
  * These tests generates and run a random DAG of n tasks and at most m edges,
  * and make all dependencies are satisfied.
  */
-TestResults strictGraphDepsTestBase(ITaskSystem*t, int n, int m, unsigned int seed) {
+TestResults strictGraphDepsTestBase(ITaskSystem*t, int n, int m, unsigned int seed, bool batch = false) {
     // For repeatability.
     srand(seed);
 
@@ -1375,13 +1982,25 @@ TestResults strictGraphDepsTestBase(ITaskSystem*t, int n, int m, unsigned int se
     }
 
     double start_time = CycleTimer::currentSeconds();
-    for (int i = 0; i < n; i++) {
-        // Populate TaskID deps.
-        for (int idx : idx_deps[i]) {
-            task_deps[i].push_back(task_ids[idx]);
+    if (batch) {
+        // The whole graph goes in as one batch, with dependencies given
+        // as node indices.
+        std::vector<BatchNode> nodes(n);
+        for (int i = 0; i < n; i++) {
+            nodes[i].runnable = tasks[i];
+            nodes[i].num_total_tasks = (rand() % 15) + 1;
+            nodes[i].batch_deps = idx_deps[i];
+        }
+        t->submitBatch(nodes);
+    } else {
+        for (int i = 0; i < n; i++) {
+            // Populate TaskID deps.
+            for (int idx : idx_deps[i]) {
+                task_deps[i].push_back(task_ids[idx]);
+            }
+            // Launch async and record this task's id.
+            task_ids[i] = t->runAsyncWithDeps(tasks[i], (rand() % 15) + 1, task_deps[i]);
         }
-        // Launch async and record this task's id.
-        task_ids[i] = t->runAsyncWithDeps(tasks[i], (rand() % 15) + 1, task_deps[i]);
     }
     t->sync();
     double end_time = CycleTimer::currentSeconds();
@@ -1392,8 +2011,414 @@ TestResults strictGraphDepsTestBase(ITaskSystem*t, int n, int m, unsigned int se
     return result;
 }
 
-TestResults strictGraphDepsSmall(ITaskSystem* t) {
-    return strictGraphDepsTestBase(t,4,2,0);
+/*
+ * Computation: Two independent chains of bulk task launches. The first is
+ * a short ping-pong chain, the second a chain of compute-heavy Fibonacci
+ * launches. The test waits on the last launch of the first chain only and
+ * checks its output before calling sync(), so an implementation of wait()
+ * can return while the second chain is still running.
+ */
+TestResults waitOnTaskTest(ITaskSystem* t) {
+    int num_elements = 32 * 1024;
+    int num_tasks = 64;
+    int num_ping_pongs = 20;
+    int num_fib_launches = 4;
+    int fib_index = 25;
+
+    int* input = new int[num_elements];
+    int* output = new int[num_elements];
+    for (int i = 0; i < num_elements; i++) {
+        input[i] = i;
+        output[i] = 0;
+    }
+    int* fib_output = new int[num_tasks];
+
+    std::vector<PingPongTask*> ping_pongs;
+    for (int i = 0; i < num_ping_pongs; i++) {
+        ping_pongs.push_back((i % 2 == 0)
+            ? new PingPongTask(num_elements, input, output, true, 2)
+            : new PingPongTask(num_elements, output, input, true, 2));
+    }
+    std::vector<RecursiveFibonacciTask*> fibs;
+    for (int i = 0; i < num_fib_launches; i++) {
+        fibs.push_back(new RecursiveFibonacciTask(fib_index, fib_output));
+    }
+
+    TestResults result;
+    result.passed = true;
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> fib_deps;
+    for (int i = 0; i < num_fib_launches; i++) {
+        TaskID id = t->runAsyncWithDeps(fibs[i], num_tasks, fib_deps);
+        fib_deps = {id};
+    }
+    std::vector<TaskID> deps;
+    for (int i = 0; i < num_ping_pongs; i++) {
+        TaskID id = t->runAsyncWithDeps(ping_pongs[i], num_tasks, deps);
+        deps = {id};
+    }
+    t->wait(deps[0]);
+
+    // Only the ping-pong chain is guaranteed to be done at this point.
+    int* buffer = (num_ping_pongs % 2 == 1) ? output : input;
+    for (int i = 0; i < num_elements; i++) {
+        int expected = i + num_ping_pongs;
+        if (buffer[i] != expected) {
+            printf("%d: %d expected=%d\n", i, buffer[i], expected);
+            result.passed = false;
+            break;
+        }
+    }
+
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    for (int i = 0; i < num_tasks; i++) {
+        if (fib_output[i] != 121393) {
+            printf("%d: %d expected=%d\n", i, fib_output[i], 121393);
+            result.passed = false;
+            break;
+        }
+    }
+    result.time = end_time - start_time;
+
+    delete [] input;
+    delete [] output;
+    delete [] fib_output;
+    for (int i = 0; i < num_ping_pongs; i++) {
+        delete ping_pongs[i];
+    }
+    for (int i = 0; i < num_fib_launches; i++) {
+        delete fibs[i];
+    }
+
+    return result;
+}
+
+/*
+ * Computation: num_chains independent chains of continuations, each step a
+ * small launch chained onto the previous one with TaskFuture::then(), so
+ * most of the time goes into handing a chain from one step to the next.
+ * Steps alternate between one task and a few. The chains are built up
+ * front, then each is polled and waited on in turn.
+ */
+TestResults futureThenTest(ITaskSystem* t) {
+    int num_chains = 16;
+    int chain_length = 200;
+    int num_steps = num_chains * chain_length;
+    auto step_tasks = [](int step) { return step % 2 == 0 ? 1 : 8; };
+
+    std::atomic<int>* done = new std::atomic<int>[num_steps];
+    for (int i = 0; i < num_steps; i++) {
+        done[i] = 0;
+    }
+    std::atomic<bool> in_order(true);
+    std::vector<ChainStepTask*> steps;
+    for (int c = 0; c < num_chains; c++) {
+        for (int s = 0; s < chain_length; s++) {
+            steps.push_back(new ChainStepTask(&done[c * chain_length], s,
+                                              s > 0 ? step_tasks(s - 1) : 0, &in_order));
+        }
+    }
+
+    TestResults result;
+    result.passed = true;
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskFuture> futures;
+    for (int c = 0; c < num_chains; c++) {
+        futures.push_back(TaskFuture(t, t->runAsyncWithDeps(steps[c * chain_length], step_tasks(0),
+                                                            std::vector<TaskID>())));
+    }
+    for (int s = 1; s < chain_length; s++) {
+        for (int c = 0; c < num_chains; c++) {
+            futures[c] = futures[c].then(steps[c * chain_length + s], step_tasks(s));
+        }
+    }
+    for (int c = 0; c < num_chains; c++) {
+        if (!futures[c].ready()) {
+            futures[c].wait();
+        }
+        int last = c * chain_length + chain_length - 1;
+        if (!futures[c].ready() || done[last] != step_tasks(chain_length - 1)) {
+            printf("chain %d: not done after wait()\n", c);
+            result.passed = false;
+        }
+    }
+    double end_time = CycleTimer::currentSeconds();
+    t->sync();
+
+    for (int i = 0; i < num_steps; i++) {
+        if (done[i] != step_tasks(i % chain_length)) {
+            printf("step %d: %d tasks ran, expected %d\n", i, done[i].load(),
+                   step_tasks(i % chain_length));
+            result.passed = false;
+            break;
+        }
+    }
+    if (!in_order) {
+        printf("a step started before the previous one finished\n");
+        result.passed = false;
+    }
+    result.time = end_time - start_time;
+
+    delete [] done;
+    for (ChainStepTask* step : steps) {
+        delete step;
+    }
+
+    return result;
+}
+
+/*
+ * Computation: under every schedule, a launch that is cancelled before it
+ * starts, with a dependent, a then() continuation and a
+ * runAsyncWithTaskDeps() successor, and a launch whose deadline passes
+ * before it starts, with a dependent. All of them wait on a gate, a
+ * single long task, so none has started when it is cancelled or when its
+ * deadline passes, and none may run a single task. A launch cancelled
+ * while it runs, and its runAsyncWithTaskDeps() successor, which is
+ * running too, must lose some of their tasks, and its dependent and
+ * then() continuation all of them, while an unrelated launch still runs
+ * in full. A task system that
+ * finishes each launch before returning from it has nothing left to
+ * cancel, and only has to run the unrelated launch.
+ */
+struct SkippedLaunch {
+    CountedSleepTask* task;
+    const char* schedule;
+    const char* kind;
+};
+
+TestResults cancelTest(ITaskSystem* t) {
+    int num_tasks = 64;
+    int sleep_us = 100;
+    int gate_us = 50000;
+    int num_running_tasks = 256;
+    int running_sleep_us = 200;
+    SchedulePolicy schedules[] = {SCHEDULE_DEFAULT, SCHEDULE_STATIC, SCHEDULE_STATIC_INTERLEAVED,
+                                  SCHEDULE_DYNAMIC, SCHEDULE_GUIDED};
+    const char* schedule_names[] = {"default", "static", "interleaved", "dynamic", "guided"};
+    int num_schedules = 5;
+
+    std::vector<SkippedLaunch> skipped;
+    CountedSleepTask gate(gate_us);
+    CountedSleepTask running(running_sleep_us);
+    CountedSleepTask running_successor(sleep_us);
+    CountedSleepTask running_dependent(sleep_us);
+    CountedSleepTask running_continuation(sleep_us);
+    CountedSleepTask bystander(sleep_us);
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    TaskID gate_id = t->runAsyncWithDeps(&gate, 1, no_deps);
+    bool asynchronous = !t->poll(gate_id);
+    std::vector<TaskID> gated = {gate_id};
+
+    for (int s = 0; s < num_schedules; s++) {
+        const char* kinds[] = {"cancelled", "dependent", "continuation", "task deps successor",
+                               "past deadline", "deadline dependent"};
+        CountedSleepTask* tasks[6];
+        for (int k = 0; k < 6; k++) {
+            tasks[k] = new CountedSleepTask(sleep_us);
+            skipped.push_back({tasks[k], schedule_names[s], kinds[k]});
+        }
+
+        LaunchHints hints;
+        hints.schedule = schedules[s];
+        TaskID head = t->runAsyncWithDeps(tasks[0], num_tasks, gated, hints);
+        t->runAsyncWithDeps(tasks[1], num_tasks, {head});
+        t->then(head, tasks[2], num_tasks);
+        t->runAsyncWithTaskDeps(tasks[3], num_tasks, head);
+        t->cancel(head);
+
+        // Long past by the time the gate opens.
+        hints.deadline = CycleTimer::currentSeconds();
+        TaskID late = t->runAsyncWithDeps(tasks[4], num_tasks, gated, hints);
+        t->runAsyncWithDeps(tasks[5], num_tasks, {late});
+    }
+
+    TaskID running_id = t->runAsyncWithDeps(&running, num_running_tasks, no_deps);
+    t->runAsyncWithTaskDeps(&running_successor, num_running_tasks, running_id);
+    t->runAsyncWithDeps(&running_dependent, num_tasks, {running_id});
+    t->then(running_id, &running_continuation, num_tasks);
+    t->cancel(running_id);
+
+    t->runAsyncWithDeps(&bystander, num_tasks, gated);
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    if (asynchronous) {
+        for (const SkippedLaunch& launch : skipped) {
+            if (launch.task->num_run_ != 0) {
+                printf("%s %s: %d tasks ran, expected 0\n", launch.schedule, launch.kind,
+                       launch.task->num_run_.load());
+                result.passed = false;
+            }
+        }
+        if (running.num_run_ == num_running_tasks || running_successor.num_run_ == num_running_tasks) {
+            printf("cancelled while running: %d and %d tasks ran, expected fewer than %d\n",
+                   running.num_run_.load(), running_successor.num_run_.load(), num_running_tasks);
+            result.passed = false;
+        }
+        if (running_dependent.num_run_ != 0 || running_continuation.num_run_ != 0) {
+            printf("cancelled while running: dependent and continuation ran %d and %d tasks, expected 0\n",
+                   running_dependent.num_run_.load(), running_continuation.num_run_.load());
+            result.passed = false;
+        }
+    }
+    if (bystander.num_run_ != num_tasks) {
+        printf("bystander: %d tasks ran, expected %d\n", bystander.num_run_.load(), num_tasks);
+        result.passed = false;
+    }
+    result.time = end_time - start_time;
+
+    for (const SkippedLaunch& launch : skipped) {
+        delete launch.task;
+    }
+
+    return result;
+}
+
+/*
+ * Computation: bursts of short sleeping tasks separated by idle gaps long
+ * enough for a thread pool to park, or in an elastic pool retire, its
+ * workers (see -e). Each burst must still run all of its tasks, and the
+ * reported time, which leaves out the gaps, shows how long the pool takes
+ * to get going again.
+ */
+TestResults idleGapTest(ITaskSystem* t) {
+    int num_bursts = 5;
+    int num_tasks = 64;
+    int sleep_us = 100;
+    int gap_ms = 30;
+
+    TestResults result;
+    result.passed = true;
+    result.time = 0;
+    for (int i = 0; i < num_bursts; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(gap_ms));
+
+        CountedSleepTask task(sleep_us);
+        double start_time = CycleTimer::currentSeconds();
+        t->run(&task, num_tasks);
+        result.time += CycleTimer::currentSeconds() - start_time;
+
+        if (task.num_run_ != num_tasks) {
+            printf("burst %d: %d tasks ran, expected %d\n", i, task.num_run_.load(), num_tasks);
+            result.passed = false;
+        }
+    }
+    return result;
+}
+
+/*
+ * Computation: a random DAG of n bulk task launches and at most m edges is
+ * captured once into a TaskGraph, then replayed num_frames times with a
+ * sync() after each frame, as a per-frame workload would. Every launch
+ * checks on every frame that its dependencies finished that frame first.
+ */
+TestResults graphReplayTestBase(ITaskSystem* t, int n, int m, int num_frames, unsigned int seed) {
+    srand(seed);
+
+    std::vector<int> idx_deps[n];
+    std::vector<FrameDependencyTask*> task_deps[n];
+    std::set<std::pair<int,int> > eset;
+    for (int i = 0; i < m; i++) {
+        int s = rand() % n;
+        int t = rand() % n;
+        if (s > t) {
+            std::swap(s,t);
+        }
+        if (s == t || eset.count({s,t})) {
+            continue;
+        }
+        idx_deps[t].push_back(s);
+        eset.insert({s,t});
+    }
+
+    std::vector<FrameDependencyTask*> tasks;
+    for (int i = 0; i < n; i++) {
+        tasks.push_back(new FrameDependencyTask(task_deps[i]));
+        for (int idx : idx_deps[i]) {
+            task_deps[i].push_back(tasks[idx]);
+        }
+    }
+
+    // Capture the DAG through the same calls a direct submission makes.
+    TaskGraphRecorder recorder;
+    std::vector<TaskID> task_ids;
+    for (int i = 0; i < n; i++) {
+        std::vector<TaskID> deps;
+        for (int idx : idx_deps[i]) {
+            deps.push_back(task_ids[idx]);
+        }
+        task_ids.push_back(recorder.runAsyncWithDeps(tasks[i], (rand() % 15) + 1, deps));
+    }
+    TaskGraph graph = recorder.graph();
+
+    double start_time = CycleTimer::currentSeconds();
+    for (int frame = 0; frame < num_frames; frame++) {
+        t->replay(graph);
+        t->sync();
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    for (int i = 0; i < n; i++) {
+        if (!tasks[i]->passed(num_frames)) {
+            printf("launch %d ran out of order or missed a frame\n", i);
+            result.passed = false;
+            break;
+        }
+    }
+    result.time = end_time - start_time;
+
+    for (int i = 0; i < n; i++) {
+        delete tasks[i];
+    }
+    return result;
+}
+
+TestResults graphReplayTest(ITaskSystem* t) {
+    return graphReplayTestBase(t, 200, 2000, 50, 0);
+}
+
+/*
+ * Computation: Fibonacci numbers computed by NestedFibonacciTask, so that
+ * tasks launch and wait for nested bulk launches on the same task system,
+ * up to 15 levels deep. Every thread of the task system ends up waiting
+ * inside a task at some point, so a task system that just blocks there
+ * deadlocks.
+ */
+TestResults nestedFibonacciTest(ITaskSystem* t) {
+    int num_bulk_task_launches = 4;
+    int fib_index = 30;
+
+    double start_time = CycleTimer::currentSeconds();
+    TestResults result;
+    result.passed = true;
+    for (int i = 0; i < num_bulk_task_launches; i++) {
+        NestedFibonacciTask root(t, fib_index, fib_index);
+        t->run(&root, 2);
+        if (root.output_[0] != 1346269 || root.output_[1] != 1346269) {
+            printf("%d %d expected=%d\n", root.output_[0], root.output_[1], 1346269);
+            result.passed = false;
+            break;
+        }
+    }
+    double end_time = CycleTimer::currentSeconds();
+    result.time = end_time - start_time;
+
+    return result;
+}
+
+TestResults strictGraphDepsSmall(ITaskSystem* t) {
+    return strictGraphDepsTestBase(t,4,2,0);
 }
 
 TestResults strictGraphDepsMedium(ITaskSystem* t) {
@@ -1403,3 +2428,271 @@ TestResults strictGraphDepsMedium(ITaskSystem* t) {
 TestResults strictGraphDepsLarge(ITaskSystem* t) {
     return strictGraphDepsTestBase(t,1000,20000,0);
 }
+
+TestResults strictGraphDepsLargeBatch(ITaskSystem* t) {
+    return strictGraphDepsTestBase(t,1000,20000,0,true);
+}
+
+/*
+ * Computation: a long chain of single-task launches next to many wide,
+ * independent launches with the same total amount of work per thread.
+ * The wide launches are submitted first, so a task system that runs
+ * ready launches in the order they became ready only starts the chain
+ * once they are all under way, and takes about twice as long as one
+ * that runs the chain first and fits the wide launches around it. The
+ * first link must start before half of the wide tasks are done, unless
+ * the task system ran the wide launches before returning from them. With
+ * replay, the same launches are recorded and replayed as one graph.
+ */
+TestResults criticalPathTestBase(ITaskSystem* t, bool replay) {
+    int num_wide = 32;
+    int num_wide_tasks = 16;
+    int wide_sleep_us = 500;
+    // Longer than a wide launch has tasks, so the chain is the critical
+    // path even with a single thread.
+    int chain_length = 32;
+
+    // One link of the chain sleeps as long as a thread spends on its
+    // share of the wide launches, divided evenly over the links.
+    int chain_sleep_us = num_wide * num_wide_tasks * wide_sleep_us / 4 / chain_length;
+
+    std::atomic<int> wide_done(0);
+    std::atomic<int> chain_done(0);
+    std::vector<WatchedSleepTask*> wide;
+    std::vector<WatchedSleepTask*> chain;
+    for (int i = 0; i < num_wide; i++) {
+        wide.push_back(new WatchedSleepTask(wide_sleep_us, &wide_done, &chain_done));
+    }
+    for (int i = 0; i < chain_length; i++) {
+        chain.push_back(new WatchedSleepTask(chain_sleep_us, &chain_done, &wide_done));
+    }
+
+    TaskGraphRecorder recorder;
+    ITaskSystem *target = replay ? static_cast<ITaskSystem*>(&recorder) : t;
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    TaskID last_wide = 0;
+    for (int i = 0; i < num_wide; i++) {
+        last_wide = target->runAsyncWithDeps(wide[i], num_wide_tasks, no_deps);
+    }
+    bool asynchronous = replay || !t->poll(last_wide);
+    std::vector<TaskID> deps;
+    for (int i = 0; i < chain_length; i++) {
+        deps = {target->runAsyncWithDeps(chain[i], 1, deps)};
+    }
+    if (replay) {
+        TaskGraph graph = recorder.graph();
+        start_time = CycleTimer::currentSeconds();
+        t->replay(graph);
+        asynchronous = wide_done < num_wide * num_wide_tasks;
+        t->sync();
+    } else {
+        t->sync();
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = wide_done == num_wide * num_wide_tasks && chain_done == chain_length;
+    int wide_done_at_chain_start = chain[0]->watched_at_start_.load();
+    if (asynchronous && wide_done_at_chain_start >= num_wide * num_wide_tasks / 2) {
+        printf("the chain started after %d of %d wide tasks were done\n", wide_done_at_chain_start,
+               num_wide * num_wide_tasks);
+        result.passed = false;
+    }
+    for (int i = 0; i < num_wide; i++) {
+        delete wide[i];
+    }
+    for (int i = 0; i < chain_length; i++) {
+        delete chain[i];
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+TestResults criticalPathTest(ITaskSystem* t) {
+    return criticalPathTestBase(t, false);
+}
+
+TestResults criticalPathReplayTest(ITaskSystem* t) {
+    return criticalPathTestBase(t, true);
+}
+
+/*
+ * Computation: a producer that submits several long chains of small
+ * launches as fast as it can, far ahead of the workers, much like a loop
+ * over runAsyncWithDeps() that never stops. Run it with -l (and -w) to
+ * hold the task system to a cap: every launch must still run once, after
+ * the one before it in its chain. A launch that is rejected is submitted
+ * again once the oldest recent launch is done, then the next oldest, and
+ * so on.
+ */
+TestResults runawaySubmissionTest(ITaskSystem* t) {
+    int num_chains = 8;
+    int chain_length = 1000;
+    int num_tasks = 4;
+
+    int num_launches = num_chains * chain_length;
+    std::atomic<int>* done = new std::atomic<int>[num_launches];
+    std::atomic<bool> in_order(true);
+    std::vector<ChainStepTask*> steps;
+    for (int i = 0; i < num_launches; i++) {
+        done[i] = 0;
+        // Step k of chain c counts itself in done[c * chain_length + k].
+        steps.push_back(new ChainStepTask(done + i / chain_length * chain_length, i % chain_length,
+                                          num_tasks, &in_order));
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> tails(num_chains);
+    int num_rejected = 0;
+    for (int k = 0; k < chain_length; k++) {
+        for (int c = 0; c < num_chains; c++) {
+            std::vector<TaskID> deps;
+            if (k > 0) {
+                deps.push_back(tails[c]);
+            }
+            // tails[c] is the oldest of the last num_chains launches and
+            // tails[c - 1] the newest.
+            TaskID id;
+            int newer = 0;
+            while ((id = t->runAsyncWithDeps(steps[c * chain_length + k], num_tasks, deps)) == REJECTED_TASK) {
+                num_rejected++;
+                t->wait(tails[(c + newer) % num_chains]);
+                newer = std::min(newer + 1, num_chains - 1);
+            }
+            tails[c] = id;
+        }
+    }
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = in_order.load();
+    for (int i = 0; i < num_launches; i++) {
+        if (done[i] != num_tasks) {
+            printf("launch %d: %d tasks ran, expected %d\n", i, done[i].load(), num_tasks);
+            result.passed = false;
+            break;
+        }
+    }
+    if (!in_order.load()) {
+        printf("a launch ran before the one it depends on was done\n");
+    }
+    if (num_rejected > 0) {
+        printf("%d launches were rejected and submitted again\n", num_rejected);
+    }
+    result.time = end_time - start_time;
+
+    for (int i = 0; i < num_launches; i++) {
+        delete steps[i];
+    }
+    delete[] done;
+    return result;
+}
+
+/*
+ * Launches enough empty bulk launches for a task system that recycles a
+ * handful of slots to wrap their generations around, while one held
+ * launch stays unfinished throughout. A TaskID may only come back once
+ * the launch it named is done, and not before at least
+ * MIN_TASK_ID_REUSE other launches, so that a stale ID held for a while
+ * still names a finished launch. A task system that finishes each launch
+ * before returning has nothing to tell apart, so only its waits are
+ * checked.
+ */
+TestResults taskIdReuseTest(ITaskSystem* t) {
+    const int MIN_TASK_ID_REUSE = 32767;
+    int num_launches = 2200000;
+    int output = 0;
+    LightTask task(&output);
+    HeldTask gate;
+
+    std::vector<TaskID> ids(num_launches);
+    std::vector<TaskID> no_deps;
+    double start_time = CycleTimer::currentSeconds();
+    ids[0] = t->runAsyncWithDeps(&gate, 1, no_deps);
+    bool asynchronous = !t->poll(ids[0]);
+    for (int i = 1; i < num_launches; i++) {
+        ids[i] = t->runAsyncWithDeps(&task, 0, no_deps);
+    }
+    gate.open_.store(true);
+    t->wait(ids[0]);
+    t->wait(ids[num_launches / 2]);
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = gate.num_run_ == 1;
+    for (int i = 1; asynchronous && i < num_launches; i++) {
+        if (ids[i] == ids[0]) {
+            printf("launch %d got TaskID %d while the launch it names was unfinished\n", i, ids[i]);
+            result.passed = false;
+            break;
+        }
+    }
+
+    std::vector<std::pair<TaskID, int>> by_id(num_launches);
+    for (int i = 0; i < num_launches; i++) {
+        by_id[i] = {ids[i], i};
+    }
+    std::sort(by_id.begin(), by_id.end());
+    for (int i = 1; asynchronous && i < num_launches; i++) {
+        if (by_id[i].first == by_id[i - 1].first && by_id[i].second - by_id[i - 1].second < MIN_TASK_ID_REUSE) {
+            printf("TaskID %d came back after %d launches\n", by_id[i].first,
+                   by_id[i].second - by_id[i - 1].second);
+            result.passed = false;
+            break;
+        }
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Several tasks submit large batches at once while most of the task
+ * system's capacity is still held by launches waiting on a slow one.
+ * Together the batches need more room than there is, so a task system
+ * that fills a batch piecemeal can end up with every batch holding part
+ * of what it needs and waiting for the rest.
+ */
+TestResults concurrentBatchTest(ITaskSystem* t) {
+    int num_batches = 3;
+    int batch_size = 32768;
+    int num_held = 40000;
+    int gate_us = 50000;
+    int output = 0;
+    LightTask task(&output);
+    CountedSleepTask gate(gate_us);
+
+    std::vector<BatchNode> nodes(batch_size);
+    for (int i = 0; i < batch_size; i++) {
+        nodes[i].runnable = &task;
+        nodes[i].num_total_tasks = 0;
+    }
+    std::vector<std::vector<TaskID>> task_ids(num_batches);
+    BatchSubmitTask submit(t, &nodes, task_ids.data());
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    std::vector<TaskID> gated = {t->runAsyncWithDeps(&gate, 1, no_deps)};
+    for (int i = 0; i < num_held; i++) {
+        t->runAsyncWithDeps(&task, 0, gated);
+    }
+    t->runAsyncWithDeps(&submit, num_batches, no_deps);
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = gate.num_run_ == 1;
+    for (int i = 0; i < num_batches; i++) {
+        if (static_cast<int>(task_ids[i].size()) != batch_size) {
+            printf("batch %d: %d TaskIDs, expected %d\n", i, static_cast<int>(task_ids[i].size()), batch_size);
+            result.passed = false;
+        }
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+#endif